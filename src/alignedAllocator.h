@@ -0,0 +1,52 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+#include <vector>
+
+/// Cache line size assumed for attribute arrays
+const static size_t CACHE_LINE_BYTES = 64;
+
+/**
+ * Allocator that starts every array on a cache line, so SIMD loops over
+ * attribute arrays can use aligned loads and arrays never share a line.
+ * The offset to the original malloc pointer is stored in front of the array.
+ */
+template<typename T, size_t Alignment = CACHE_LINE_BYTES>
+struct AlignedAllocator {
+  typedef T value_type;
+
+  template<typename U>
+  struct rebind { typedef AlignedAllocator<U, Alignment> other; };
+
+  AlignedAllocator() {}
+  template<typename U>
+  AlignedAllocator(const AlignedAllocator<U, Alignment> &) {}
+
+  T *allocate(size_t n) {
+    void *original = std::malloc(n * sizeof(T) + Alignment);
+    if (!original) {
+      throw std::bad_alloc();
+    }
+    uintptr_t aligned = (reinterpret_cast<uintptr_t>(original) + Alignment) & ~(uintptr_t)(Alignment - 1);
+    reinterpret_cast<void **>(aligned)[-1] = original;
+    return reinterpret_cast<T *>(aligned);
+  }
+
+  void deallocate(T *p, size_t) {
+    if (p) {
+      std::free(reinterpret_cast<void **>(p)[-1]);
+    }
+  }
+
+  template<typename U>
+  bool operator==(const AlignedAllocator<U, Alignment> &) const { return true; }
+  template<typename U>
+  bool operator!=(const AlignedAllocator<U, Alignment> &) const { return false; }
+};
+
+/// Contiguous cache line aligned array
+template<typename T>
+using AlignedVector = std::vector<T, AlignedAllocator<T>>;
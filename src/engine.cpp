@@ -1,97 +1,308 @@
 #include "engine.h"
 
+#include <algorithm>
 #include <fstream>
 #include <iostream>
+#include <limits>
 
 #include "util.h"
 #include "constitutiveModel.h"
+#include "meshSdf.h"
 #include "plasticity.h"
 
-const static bool USE_QUADRATIC_WEIGHT = true;
+// P2G bins particles into the grid tiles, GRID_TILE must be at least the widest stencil width - 1
+static_assert(GRID_TILE >= 3, "Stencils of same colored tiles would overlap");
 
-Engine::Engine() : grid_(params.gridX, params.gridY, params.gridZ, params.spacing), particleList_() {}
+Engine::Engine() : Engine(mkS<ThreadPool>(params.numThreads)) {}
+
+Engine::Engine(sPtr<ThreadPool> pool) :
+  grid_(params.gridX, params.gridY, params.gridZ, params.spacing, params.gridLayout),
+  particleList_(),
+  pool_(std::move(pool))
+{}
 
 Engine::~Engine() {}
 
-template<typename F>
-void Engine::iterWeight(const Vec3f &posInGrid, F&& updateFunc) {
-  Mat3f weight = quadWeight(posInGrid);
-  Vec3i baseIdx = floor(posInGrid - Vec3f::Constant(0.5f));
-  for (int i = 0; i < 3; i++) {
-    for (int j = 0; j < 3; j++) {
-      for (int k = 0; k < 3; k++) {
+template<class Kernel, typename F>
+inline void Engine::iterWeight(const Stencil<Kernel> &stencil, F&& updateFunc) {
+  const typename Stencil<Kernel>::Weights &weight = stencil.weight;
+  // Only particles that left the domain need per node checks
+  bool stored = grid_.isStoredStencil(stencil.base, Kernel::width);
+  for (int i = 0; i < Kernel::width; i++) {
+    for (int j = 0; j < Kernel::width; j++) {
+      for (int k = 0; k < Kernel::width; k++) {
         Vec3i t; t << i, j, k;
-        Vec3i blockPosIdx = baseIdx + t;
-        if (!grid_.isValidIdx(blockPosIdx)) {
+        Vec3i blockPosIdx = stencil.base + t;
+        if (!stored && !grid_.isStoredIdx(blockPosIdx)) {
           continue;
         }
         Float w = weight(0, i) * weight(1, j) * weight(2, k);
-        updateFunc(blockPosIdx, w);
+        updateFunc(blockPosIdx, grid_.getBlockAtUnchecked(blockPosIdx), w);
       }
     }
   }
 }
 
-template<typename F>
-void Engine::iterWeightGrad(const Vec3f &posInGrid, F&& updateFunc) {
-  Mat3f weight = quadWeight(posInGrid);
-  Mat3f dweight = quadWeightDeriv(posInGrid);
-  Vec3i baseIdx = floor(posInGrid - Vec3f::Constant(0.5f));
-  for (int i = 0; i < 3; i++) {
-    for (int j = 0; j < 3; j++) {
-      for (int k = 0; k < 3; k++) {
+template<class Kernel, typename F>
+inline void Engine::iterWeightGrad(const Stencil<Kernel> &stencil, F&& updateFunc) {
+  const typename Stencil<Kernel>::Weights &weight = stencil.weight;
+  const typename Stencil<Kernel>::Weights &dweight = stencil.weightDeriv;
+  bool stored = grid_.isStoredStencil(stencil.base, Kernel::width);
+  for (int i = 0; i < Kernel::width; i++) {
+    for (int j = 0; j < Kernel::width; j++) {
+      for (int k = 0; k < Kernel::width; k++) {
         Vec3f weightGrad;
         weightGrad(0) = dweight(0, i) * weight(1, j) * weight(2, k);
         weightGrad(1) = weight(0, i) * dweight(1, j) * weight(2, k);
         weightGrad(2) = weight(0, i) * weight(1, j) * dweight(2, k);
         weightGrad /= grid_.spacing_;
         Vec3i t; t << i, j, k;
-        Vec3i blockPosIdx = baseIdx + t;
-        if (!grid_.isValidIdx(blockPosIdx)) {
+        Vec3i blockPosIdx = stencil.base + t;
+        if (!stored && !grid_.isStoredIdx(blockPosIdx)) {
           continue;
         }
         Float w = weight(0, i) * weight(1, j) * weight(2, k);
-        updateFunc(blockPosIdx, weightGrad, w);
+        updateFunc(blockPosIdx, grid_.getBlockAtUnchecked(blockPosIdx), weightGrad, w);
       }
     }
   }
 }
 
+template<class Kernel>
+StencilCache<Kernel> &Engine::stencilCache() {
+  if (!stencilCache_ || stencilCache_->kernel() != Kernel::type) {
+    stencilCache_ = mkU<StencilCache<Kernel>>(params.stencilCacheBudget);
+  }
+  stencilCache_->setBudget(params.stencilCacheBudget);
+  return static_cast<StencilCache<Kernel> &>(*stencilCache_);
+}
+
+template<class Kernel>
+const Stencil<Kernel> &Engine::particleStencil(int i, const Vec3f &posInGrid,
+                                               Stencil<Kernel> *scratch) const {
+  if (stencilCache_ && stencilCache_->valid() && stencilCache_->kernel() == Kernel::type) {
+    return static_cast<const StencilCache<Kernel> &>(*stencilCache_)[i];
+  }
+  computeStencil(posInGrid, scratch);
+  return *scratch;
+}
+
 void Engine::execOneStep() {
     P2GTransfer();
     updateGridState();
     G2PTransfer();
     grid_.reset();
+    advanceObstacles();
+    step_++;
+}
+
+void Engine::advanceObstacles() {
+  if (!grid_.movingObstacles()) {
+    return;
+  }
+  // Box around the moving level sets before and after the step
+  Vec3f lo = Vec3f::Constant(std::numeric_limits<Float>::max()), hi = -lo;
+  bool bounded = true;
+  auto addBounds = [&](const LevelSet &ls) {
+    Vec3f boundLo, boundHi;
+    if (!ls.bounds(boundLo, boundHi)) {
+      bounded = false;
+      return;
+    }
+    lo = lo.cwiseMin(boundLo);
+    hi = hi.cwiseMax(boundHi);
+  };
+  for (const uPtr<LevelSet> &ls : levelSets) {
+    if (ls->moving()) {
+      addBounds(*ls);
+      ls->advance(params.timeStep);
+      addBounds(*ls);
+    }
+  }
+  if (bounded) {
+    grid_.resampleLevelSets(lo, hi, pool_.get());
+  } else {
+    grid_.parseLevelSets(levelSets, pool_.get());
+  }
+}
+
+template<class Kernel>
+void Engine::binParticles() {
+  const AlignedVector<Vec3f> &pos = particleList_.pos_;
+  int numParticles = particleList_.size();
+  tileDim_ = grid_.tileDim();
+  int numTiles = tileDim_.prod();
+  particleTile_.resize(numParticles);
+  pool_->parallelFor(numParticles, 4096, [&](int begin, int end) {
+    for (int i = begin; i < end; i++) {
+      Vec3f posIdx = pos[i] / grid_.spacing_;
+      Vec3i base;
+      for (int j = 0; j < 3; j++) {
+        base[j] = Kernel::baseNode(posIdx[j]);
+      }
+      particleTile_[i] = grid_.tileOf(base);
+    }
+  });
+  // Counting sort by tile
+  tileStart_.assign(numTiles + 1, 0);
+  for (int tile : particleTile_) {
+    tileStart_[tile + 1]++;
+  }
+  // Locality: runs of consecutive particles in the same tile
+  int tileRuns = 0;
+  for (int i = 0; i < numParticles; i++) {
+    tileRuns += i == 0 || particleTile_[i] != particleTile_[i - 1];
+  }
+  bool periodic = params.reorderInterval > 0 && step_ % params.reorderInterval == 0;
+  bool degraded = numParticles < params.reorderMinRunLength * tileRuns;
+  if (numParticles > 0 && (periodic || degraded)) {
+    reorderParticles<Kernel>();
+  }
+  for (int t = 0; t < numTiles; t++) {
+    tileStart_[t + 1] += tileStart_[t];
+  }
+  std::vector<int> tileFill(tileStart_.begin(), tileStart_.end() - 1);
+  tileParticles_.resize(numParticles);
+  for (int i = 0; i < numParticles; i++) {
+    tileParticles_[tileFill[particleTile_[i]]++] = i;
+  }
+  for (std::vector<int> &tiles : colorTiles_) {
+    tiles.clear();
+  }
+  occupiedTiles_.clear();
+  for (int t = 0; t < numTiles; t++) {
+    if (tileStart_[t] == tileStart_[t + 1]) {
+      continue;
+    }
+    int x = t % tileDim_[0],
+        y = (t / tileDim_[0]) % tileDim_[1],
+        z = t / (tileDim_[0] * tileDim_[1]);
+    colorTiles_[(x & 1) | (y & 1) << 1 | (z & 1) << 2].push_back(t);
+    occupiedTiles_.push_back(t);
+  }
+}
+
+template<class Kernel>
+void Engine::reorderParticles() {
+  profiler.profStart(ProfType::REORDER);
+  const AlignedVector<Vec3f> &pos = particleList_.pos_;
+  int numParticles = particleList_.size();
+  // Sort by the stencil base node, so every tile is one contiguous run afterwards
+  std::vector<uint64_t> keys(numParticles);
+  pool_->parallelFor(numParticles, 4096, [&](int begin, int end) {
+    for (int i = begin; i < end; i++) {
+      Vec3f posIdx = pos[i] / grid_.spacing_;
+      Vec3i base;
+      for (int j = 0; j < 3; j++) {
+        base[j] = Kernel::baseNode(posIdx[j]);
+      }
+      // Morton blocks of GRID_TILE^3 line up with the tiles in storage coordinates
+      keys[i] = mortonCode(grid_.paddedIdx(base));
+    }
+  });
+  std::vector<int> order(numParticles);
+  for (int i = 0; i < numParticles; i++) {
+    order[i] = i;
+  }
+  std::stable_sort(order.begin(), order.end(), [&](int a, int b) { return keys[a] < keys[b]; });
+  particleList_.permute(order);
+  std::vector<int> sortedTile(numParticles);
+  for (int i = 0; i < numParticles; i++) {
+    sortedTile[i] = particleTile_[order[i]];
+  }
+  particleTile_.swap(sortedTile);
+  profiler.profCount(ProfType::REORDER, numParticles);
+  profiler.profEnd(ProfType::REORDER);
+}
+
+template<typename F>
+void Engine::scatterParticles(F&& scatterFunc) {
+  const ParticleList &particles = particleList_;
+  for (const std::vector<int> &tiles : colorTiles_) {
+    pool_->parallelFor(tiles.size(), 1, [&](int begin, int end) {
+      for (int t = begin; t < end; t++) {
+        int tile = tiles[t];
+        for (int i = tileStart_[tile]; i < tileStart_[tile + 1]; i++) {
+          int idx = tileParticles_[i];
+          scatterFunc(idx, particles[idx]);
+        }
+      }
+    });
+  }
+}
+
+void Engine::P2GTransfer() {
+  switch (params.kernel) {
+    case InterpKernel::LINEAR:
+      // MLS needs the exact D^-1, which doesn't exist at the nodes of this kernel
+      CHECK(params.transfer != TransferScheme::MLS) << "MLS-MPM needs the quadratic or cubic kernel";
+      P2GTransfer<LinearKernel>();
+      break;
+    case InterpKernel::QUADRATIC:
+      P2GTransfer<QuadraticKernel>();
+      break;
+    case InterpKernel::CUBIC:
+      P2GTransfer<CubicKernel>();
+      break;
+  }
 }
 
+template<class Kernel>
 void Engine::P2GTransfer() {
   profiler.profStart(ProfType::P2G_TRANSFER);
-  for (Particle &p : *(particleList_.particles_)) {
-    Vec3f posIdx = p.pos / grid_.spacing_;
-    iterWeight(posIdx, [&](const Vec3i &blockPosIdx, Float weight) {
-      Block &block = grid_.getBlockAt(blockPosIdx);
-      block.mass += weight * p.mass;
-      Vec3f affineTerm = 4.f * p.Bp / grid_.spacing_ * (blockPosIdx.cast<Float>() - posIdx);
-      block.vel += weight * p.mass * (p.vel + affineTerm);
+  binParticles<Kernel>();
+  grid_.prepareTiles(occupiedTiles_, pool_.get());
+  // Positions stay fixed until G2P advects them, fill the stencils once for all stages
+  stencilCache<Kernel>().fill(particleList_.pos_, grid_.spacing_, pool_.get());
+  if (params.transfer == TransferScheme::APIC_FUSED) {
+    // One stencil evaluation per particle for mass, momentum and force
+    scatterParticles([&](int idx, const ConstParticleRef &p) {
+      Mat3f Ap = particleStress(p);
+      Vec3f posIdx = p.pos / grid_.spacing_;
+      Stencil<Kernel> scratch;
+      iterWeightGrad(particleStencil(idx, posIdx, &scratch), [&](const Vec3i &blockPosIdx, Block &block, const Vec3f &weightGrad, Float weight) {
+        block.mass += weight * p.mass;
+        Vec3f affineTerm = Kernel::dInv() * p.Bp / grid_.spacing_ * (blockPosIdx.cast<Float>() - posIdx);
+        block.vel += weight * p.mass * (p.vel + affineTerm);
+        block.f += -Ap * weightGrad;
+      });
+    });
+  } else if (params.transfer == TransferScheme::MLS) {
+    // MLS-MPM approximates the weight gradient by weight * D^-1 * (x_i - x_p), so
+    // dt times the grid force joins the affine momentum and no gradient is needed
+    Float dInvOverH = Kernel::dInv() / grid_.spacing_;
+    scatterParticles([&](int idx, const ConstParticleRef &p) {
+      Mat3f affine = dInvOverH * (p.mass * p.Bp - params.timeStep * particleStress(p));
+      Vec3f posIdx = p.pos / grid_.spacing_;
+      Stencil<Kernel> scratch;
+      iterWeight(particleStencil(idx, posIdx, &scratch), [&](const Vec3i &blockPosIdx, Block &block, Float weight) {
+        block.mass += weight * p.mass;
+        block.vel += weight * (p.mass * p.vel + affine * (blockPosIdx.cast<Float>() - posIdx));
+      });
+    });
+  } else {
+    scatterParticles([&](int idx, const ConstParticleRef &p) {
+      Vec3f posIdx = p.pos / grid_.spacing_;
+      Stencil<Kernel> scratch;
+      iterWeight(particleStencil(idx, posIdx, &scratch), [&](const Vec3i &blockPosIdx, Block &block, Float weight) {
+        block.mass += weight * p.mass;
+        Vec3f affineTerm = Kernel::dInv() * p.Bp / grid_.spacing_ * (blockPosIdx.cast<Float>() - posIdx);
+        block.vel += weight * p.mass * (p.vel + affineTerm);
+      });
     });
   }
-  for (int i = 0; i < (*grid_.blocks_).size(); i++) {
-    Block &block = (*grid_.blocks_)[i];
-    if (block.mass != 0.f) {
-      block.vel /= block.mass;
-      grid_.nonEmptyBlocks_.insert(i);
-    }
-  }
+  grid_.buildActiveList(pool_.get());
+  profiler.profCount(ProfType::P2G_TRANSFER, particleList_.size());
   profiler.profEnd(ProfType::P2G_TRANSFER);
 }
 
 void Engine::CHECK_MASS() {
 #ifdef MPM_DEBUG
   Float particlesMass = 0.f, gridMass = 0.f;
-  for (const Particle &p : (*particleList_.particles_)) {
-    particlesMass += p.mass;
+  for (Float mass : particleList_.mass_) {
+    particlesMass += mass;
   }
-  for (int idx : grid_.nonEmptyBlocks_) {
+  for (int idx : grid_.activeBlocks_) {
     gridMass += (*grid_.blocks_)[idx].mass;
   }
   LOG(INFO) << "Particle mass: " << particlesMass;
@@ -99,74 +310,124 @@ void Engine::CHECK_MASS() {
 #endif
 }
 
+void Engine::G2PTransfer() {
+  switch (params.kernel) {
+    case InterpKernel::LINEAR:
+      G2PTransfer<LinearKernel>();
+      break;
+    case InterpKernel::QUADRATIC:
+      G2PTransfer<QuadraticKernel>();
+      break;
+    case InterpKernel::CUBIC:
+      G2PTransfer<CubicKernel>();
+      break;
+  }
+}
+
+template<class Kernel>
 void Engine::G2PTransfer() {
   profiler.profStart(ProfType::G2P_TRANSFER);
-  for (Particle &p : *(particleList_.particles_)) {
-    Vec3f posIdx = p.pos / grid_.spacing_;
-    p.vel = Vec3f::Constant(0.f);
-    p.Bp = Mat3f::Constant(0.f);
-    Mat3f updateF = Mat3f::Identity();
-    iterWeightGrad(posIdx, [&](const Vec3i &blockPosIdx, const Vec3f &weightGrad, Float weight) {
-      const Block &block = grid_.getBlockAt(blockPosIdx);
-      updateF += params.timeStep * block.vel * weightGrad.transpose();
-      p.vel += weight * block.vel;
-      Vec3f diffPos = blockPosIdx.cast<Float>() * grid_.spacing_ - p.pos;
-      p.Bp += weight * block.vel * diffPos.transpose();
-    });
-    // Update deformation gradient
-    // For snow, assume all the deformation is plastic
-    p.Fe = updateF * p.Fe;
-    // Plasticity hardening
-    if (params.pType == ParticleType::SAND) {
-      plasticityHardening(&p);
-    } else if (params.pType == ParticleType::SNOW) {
-      snowHardening(&p);
+  ParticleList &particles = particleList_;
+  bool mls = params.transfer == TransferScheme::MLS;
+  // Each particle only reads the grid and writes itself. Chunks are claimed
+  // dynamically, so chunks with expensive plasticity projections don't stall a thread
+  pool_->parallelFor(particles.size(), params.g2pChunkSize, [&](int begin, int end) {
+    for (int i = begin; i < end; i++) {
+      ParticleRef p = particles[i];
+      Vec3f posIdx = p.pos / grid_.spacing_;
+      p.vel = Vec3f::Constant(0.f);
+      p.Bp = Mat3f::Constant(0.f);
+      Mat3f updateF = Mat3f::Identity();
+      Stencil<Kernel> scratch;
+      const Stencil<Kernel> &stencil = particleStencil(i, posIdx, &scratch);
+      if (mls) {
+        iterWeight(stencil, [&](const Vec3i &blockPosIdx, const Block &block, Float weight) {
+          p.vel += weight * block.vel;
+          Vec3f diffPos = blockPosIdx.cast<Float>() * grid_.spacing_ - p.pos;
+          p.Bp += weight * block.vel * diffPos.transpose();
+        });
+        // The velocity gradient is the affine matrix C = D^-1 * Bp
+        updateF += params.timeStep * Kernel::dInv() / (grid_.spacing_ * grid_.spacing_) * p.Bp;
+      } else {
+        iterWeightGrad(stencil, [&](const Vec3i &blockPosIdx, const Block &block, const Vec3f &weightGrad, Float weight) {
+          updateF += params.timeStep * block.vel * weightGrad.transpose();
+          p.vel += weight * block.vel;
+          Vec3f diffPos = blockPosIdx.cast<Float>() * grid_.spacing_ - p.pos;
+          p.Bp += weight * block.vel * diffPos.transpose();
+        });
+      }
+      // Update deformation gradient
+      // For snow, assume all the deformation is plastic
+      p.Fe = updateF * p.Fe;
+      // Plasticity hardening
+      if (params.pType == ParticleType::SAND) {
+        plasticityHardening(p);
+      } else if (params.pType == ParticleType::SNOW) {
+        snowHardening(p);
+      }
+      // Advect
+      p.pos += p.vel * params.timeStep;
     }
-    // Advect
-    p.pos += p.vel * params.timeStep;
+  });
+  if (stencilCache_) {
+    stencilCache_->invalidate();
   }
+  profiler.profCount(ProfType::G2P_TRANSFER, particles.size());
   profiler.profEnd(ProfType::G2P_TRANSFER);
 }
 
 void Engine::updateGridState() {
-  computeGridForce();
-  grid_.updateGridVel();
-}
-
-void Engine::computeGridForce() {
-  profiler.profStart(ProfType::CALC_GRID_FORCE);
-  for (const Particle &p : (*particleList_.particles_)) {
-    Mat3f Ap;
-    Float volume = p.mass / params.pDensity;
-    switch (particleList_.type_) {
-      case ParticleType::SAND: {
-        // Only use the elastic part
-        Mat3f piola = stVenant(p.Fe, false);
-        // Mat3f piola = fixedCorotated(p.Fe);
-        Ap = volume * piola * p.Fe.transpose();
+  if (params.transfer == TransferScheme::APIC) {
+    switch (params.kernel) {
+      case InterpKernel::LINEAR:
+        computeGridForce<LinearKernel>();
         break;
-      }
-      case ParticleType::SNOW: {
-        Mat3f piola = fixedCorotatedSnow(p.Fe, p.Fp);
-        Ap = volume * piola * p.Fe.transpose(); 
+      case InterpKernel::QUADRATIC:
+        computeGridForce<QuadraticKernel>();
         break;
-      }
-      case ParticleType::ELASTIC: {
-        Mat3f piola = fixedCorotated(p.Fe);
-        Ap = volume * piola * p.Fe.transpose();
-        break;
-      }
-      default:
-        LOG(FATAL) << "Particle type not specified!" << std::endl;
+      case InterpKernel::CUBIC:
+        computeGridForce<CubicKernel>();
         break;
     }
+  }
+  grid_.updateGridVel(pool_.get());
+}
 
+Mat3f Engine::particleStress(const ConstParticleRef &p) const {
+  Float volume = p.mass / params.pDensity;
+  switch (particleList_.type_) {
+    case ParticleType::SAND: {
+      // Only use the elastic part
+      Mat3f piola = stVenant(p.Fe, false);
+      // Mat3f piola = fixedCorotated(p.Fe);
+      return volume * piola * p.Fe.transpose();
+    }
+    case ParticleType::SNOW: {
+      Mat3f piola = fixedCorotatedSnow(p.Fe, p.Fp);
+      return volume * piola * p.Fe.transpose(); 
+    }
+    case ParticleType::ELASTIC: {
+      Mat3f piola = fixedCorotated(p.Fe);
+      return volume * piola * p.Fe.transpose();
+    }
+    default:
+      LOG(FATAL) << "Particle type not specified!" << std::endl;
+      return Mat3f::Zero();
+  }
+}
+
+template<class Kernel>
+void Engine::computeGridForce() {
+  profiler.profStart(ProfType::CALC_GRID_FORCE);
+  // Particles have not moved since P2G, so its tile bins are still valid
+  scatterParticles([&](int idx, const ConstParticleRef &p) {
+    Mat3f Ap = particleStress(p);
     Vec3f posIdx = p.pos / grid_.spacing_;
-    iterWeightGrad(posIdx, [&](const Vec3i &blockPosIdx, const Vec3f &weightGrad, Float w) {
-      Block &block = grid_.getBlockAt(blockPosIdx);
+    Stencil<Kernel> scratch;
+    iterWeightGrad(particleStencil(idx, posIdx, &scratch), [&](const Vec3i &blockPosIdx, Block &block, const Vec3f &weightGrad, Float w) {
       block.f += -Ap * weightGrad;
     });
-  }
+  });
   profiler.profEnd(ProfType::CALC_GRID_FORCE);
 }
 
@@ -187,9 +448,9 @@ void Engine::visualize(int idx) {
   
   // Count particles in each grid
   int maxParticles = 0;
-  for (const Particle &p : (*particleList_.particles_)) {
-    int gridX = p.pos(0) / gridWidth * imgSize;
-    int gridY = imgSize - p.pos(1) / gridHeight * imgSize;
+  for (const Vec3f &pos : particleList_.pos_) {
+    int gridX = pos(0) / gridWidth * imgSize;
+    int gridY = imgSize - pos(1) / gridHeight * imgSize;
     int idx = gridX + gridY * imgSize;
     CHECK(gridX < imgSize && gridY < imgSize) << "Invalid grid X: " << gridX << " Y: " << gridY << std::endl;
     output[gridX + gridY * imgSize]++;
@@ -233,10 +494,9 @@ void Engine::writePositions(const std::string &filename)
 	if (!out) {
 		throw std::runtime_error("[writePositions] cannot open file");
 	}
-	int size = particleList_.particles_->size();
+	int size = particleList_.size();
 	out.write((char*)&size, sizeof(int));
-	for (const Particle &p : (*particleList_.particles_)) {
-		Vec3f pos = p.pos;
+	for (const Vec3f &pos : particleList_.pos_) {
 		out.write((char*)&pos.x(), sizeof(Float));
 		out.write((char*)&pos.y(), sizeof(Float));
 		out.write((char*)&pos.z(), sizeof(Float));
@@ -249,8 +509,7 @@ void Engine::CHECK_PARTICLE_BOUND()
 {
 	Vec3f bound = grid_.size_.cast<Float>() * grid_.spacing_;
 	int count = 0;
-	for (Particle& particle : *(particleList_.particles_)) {
-		Vec3f pos = particle.pos;
+	for (const Vec3f &pos : particleList_.pos_) {
 		if (pos.x() > bound.x() || pos.y() > bound.y() || pos.z() > bound.z())
 		{
 			LOG(INFO) << "Particle mass: " << pos;
@@ -262,28 +521,30 @@ void Engine::CHECK_PARTICLE_BOUND()
 
 void Engine::initGrid(int x, int y, int z, Float spacing)
 {
-	grid_.spacing_ = spacing;
-  grid_.blocks_ = new std::vector<Block>(x * y * z);
-  grid_.size_(0) = x;
-  grid_.size_(1) = y;
-  grid_.size_(2) = z;
+  grid_.resize(x, y, z, spacing);
 }
 
 void Engine::initBoundary(int offset)
 {
-	Vec3f center = grid_.size_.cast<Float>() * grid_.spacing_ * 0.5f;
-	Vec3f bound = center - Vec3f::Constant(offset * grid_.spacing_);
-	levelSets.push_back(mkU<Box>(center, bound));
-	// grid_.parseLevelSets(levelSets);
+	// The walls collide by node index, level sets are left to real obstacles
+	grid_.setWalls(offset);
 }
 
-void Engine::addObstacle(uPtr<SDF> customsdf)
+void Engine::addObstacle(uPtr<LevelSet> customsdf)
 {
 	levelSets.push_back(std::move(customsdf));
 }
 
+void Engine::addMeshObstacle(const std::string &path, int band)
+{
+	TriMesh mesh = loadMesh(path);
+	LOG(INFO) << "Obstacle " << path << ": " << mesh.vertices.size() << " vertices, "
+	          << mesh.triangles.size() << " triangles";
+	addObstacle(meshToSdf(mesh, grid_.size_, grid_.spacing_, Vec3f::Zero(), band * grid_.spacing_, pool_.get()));
+}
+
 void Engine::generateLevelset()
 {
-	grid_.parseLevelSets(levelSets);
+	grid_.parseLevelSets(levelSets, pool_.get());
 }
 
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <array>
 #include <cstring>
 #include <vector>
 
@@ -8,46 +9,71 @@
 #include "grid.h"
 #include "util.h"
 #include "levelSet.h"
+#include "stencilCache.h"
+#include "threadPool.h"
 
 class Engine {
 public:
   Engine();
+
+  /**
+   * Engine running its parallel stages on an existing thread pool, so that engines
+   * created one after another, like one per Houdini solve, reuse the same threads
+   */
+  explicit Engine(sPtr<ThreadPool> pool);
   ~Engine();
 
   void initGrid(int x, int y, int z, Float spacing);
 
+  /// Put walls on the outer offset node layers of the domain
   void initBoundary(int offset = 3);
 
-  void addObstacle(uPtr<SDF> customsdf);
+  /**
+   * Collide with a level set, SDF and NarrowBandSDF volumes included. Wrap a level set
+   * in a TransformedLevelSet to move it, the grid samples moving ones every step
+   */
+  void addObstacle(uPtr<LevelSet> customsdf);
+
+  /**
+   * Collide with a closed OBJ or PLY triangle mesh, converted to an SDF on the grid nodes
+   * @param band width of the exact distances around the surface, in nodes
+   */
+  void addMeshObstacle(const std::string &path, int band = 3);
 
   void generateLevelset();
    
   /**
-   * Iterator function to iterate over nearby 3x3 cells
-   * @param posInGrid position in grid coordinate
-   * @param updateFunc modify or use the value of block or weight
+   * Iterator function to iterate over nearby width^3 cells of the kernel
+   * @param stencil stencil of the particle
+   * @param updateFunc called with the node index, its block and weight.
+   * Stencils within the stored nodes skip the per node bounds checks
    */
-  template<typename F>
-  void iterWeight(const Vec3f &posInGrid, F&& updateFunc);
+  template<class Kernel, typename F>
+  void iterWeight(const Stencil<Kernel> &stencil, F&& updateFunc);
 
   /**
-   * Iterator function to iterate over nearby 3x3 cells
-   * @param posInGrid position in grid coordinate
-   * @param updateFunc modify or use the value of block or weight gradient
+   * Iterator function to iterate over nearby width^3 cells of the kernel
+   * @param stencil stencil of the particle
+   * @param updateFunc called with the node index, its block, weight gradient and weight
    */
-  template<typename F>
-  void iterWeightGrad(const Vec3f &posInGrid, F&& updateFunc);
+  template<class Kernel, typename F>
+  void iterWeightGrad(const Stencil<Kernel> &stencil, F&& updateFunc);
 
   /// execute one time step, combines the major functions
   void execOneStep();
   
-  /// Transfer the mass and velocity from particles to grid using APIC
+  /**
+   * Transfer the mass and velocity from particles to grid using APIC.
+   * With TransferScheme::APIC_FUSED the grid forces are deposited in the same sweep,
+   * with TransferScheme::MLS the stress is part of the transferred momentum.
+   * Runs with the kernel chosen in params.kernel.
+   */
   void P2GTransfer();
 
-  /// Update grid velocities
+  /// Update grid velocities, computes the grid forces first for TransferScheme::APIC
   void updateGridState();
 
-  /// Transfer from grid to particles
+  /// Transfer from grid to particles, with the kernel chosen in params.kernel
   void G2PTransfer();
   
   /// Check mass of particles & grids, DEBUG only
@@ -60,8 +86,8 @@ public:
   /// Write particle positions
   void writePositions(const std::string &filename);
 
-  std::vector<Particle>* getParticleVecPointer() {
-	  return particleList_.particles_;
+  ParticleList &getParticleList() {
+	  return particleList_;
   }
 
   Grid grid_;
@@ -69,6 +95,80 @@ public:
   std::vector<uPtr<LevelSet>> levelSets;
 
 private:
+  /// Worker threads shared by all parallel stages, sized by params.numThreads
+  sPtr<ThreadPool> pool_;
+
+  /**
+   * Advance the level sets by one step and sample the moving ones again, only around
+   * their old and new bounds unless one is unbounded
+   */
+  void advanceObstacles();
+  /// Particle stencils of the current step, for the kernel of the current step
+  uPtr<StencilCacheBase> stencilCache_;
+
+  /// Transfer stages, one instantiation per interpolation kernel
+  template<class Kernel>
+  void P2GTransfer();
+
+  template<class Kernel>
+  void G2PTransfer();
+
   /// Calculate grid forces 
+  template<class Kernel>
   void computeGridForce();
+
+  /**
+   * Stress term of a particle for the grid force, V * P * F^T
+   * @param p particle
+   */
+  Mat3f particleStress(const ConstParticleRef &p) const;
+
+  /**
+   * Sort particles into the GRID_TILE^3 node tiles of the grid and group the tiles by color.
+   * Reorders the particles first when params.reorderInterval or params.reorderMinRunLength asks for it
+   */
+  template<class Kernel>
+  void binParticles();
+
+  /// Sort all particle attributes by the Morton code of their stencil base node
+  template<class Kernel>
+  void reorderParticles();
+
+  /// Stencil cache for a kernel, replaces the cache of a different kernel
+  template<class Kernel>
+  StencilCache<Kernel> &stencilCache();
+
+  /**
+   * Stencil of a particle, taken from the stencil cache when it is valid
+   * @param i particle index
+   * @param posInGrid particle position in grid coordinate
+   * @param scratch storage for a recomputed stencil
+   */
+  template<class Kernel>
+  const Stencil<Kernel> &particleStencil(int i, const Vec3f &posInGrid,
+                                         Stencil<Kernel> *scratch) const;
+
+  /**
+   * Run a scatter function on every particle, in parallel.
+   * Tiles are processed one color at a time, tiles of the same color are
+   * far enough apart that their stencils never write the same block.
+   * @param scatterFunc called with the index and a ConstParticleRef to the particle
+   */
+  template<typename F>
+  void scatterParticles(F&& scatterFunc);
+
+  /// Steps executed so far
+  int step_ = 0;
+  /// Number of tiles along each axis
+  Vec3i tileDim_;
+  /// Tile index of every particle
+  std::vector<int> particleTile_;
+  /// Particle indices sorted by tile
+  std::vector<int> tileParticles_;
+  /// Start of each tile in tileParticles_, one more entry than the tile count
+  std::vector<int> tileStart_;
+  /// Non-empty tiles of each of the 2x2x2 colors
+  std::array<std::vector<int>, 8> colorTiles_;
+  /// All non-empty tiles
+  std::vector<int> occupiedTiles_;
 };
\ No newline at end of file
@@ -43,6 +43,32 @@ enum class ParticleType : int { SNOW, SAND, ELASTIC };
 /// Collision type
 enum class CollisionType : int { STICKY, SEPARATING, SLIPPING };
 
+/// Particle-grid interpolation kernel
+enum class InterpKernel : int { LINEAR, QUADRATIC, CUBIC };
+
+/// How the particle state and stress reach the grid
+enum class TransferScheme : int {
+  /// APIC P2G, then a separate particle sweep for the grid forces
+  APIC,
+  /// APIC P2G that deposits the grid forces in the same particle sweep
+  APIC_FUSED,
+  /// MLS-MPM, the stress is folded into the affine term of P2G, no weight gradients.
+  /// Needs the quadratic or cubic kernel
+  MLS
+};
+
+/// Storage of the grid nodes
+enum class GridLayout : int {
+  /// Every node of the domain, x-major
+  DENSE,
+  /// GRID_TILE^3 node tiles allocated only where particles touch the grid
+  SPARSE,
+  /// Every node of the domain in GRID_TILE^3 node tiles, x-major inside a tile.
+  /// A stencil touches a few tiles instead of width^2 rows spread over z-slices.
+  /// Not faster than DENSE on binned particles in general, try it per machine
+  TILED
+};
+
 /// Global params object
 class Params {
 public:
@@ -98,8 +124,12 @@ public:
     LOG(INFO) << "Friction coefficient: " << muB;
     LOG(INFO) << "E: " << E << " " << "nu: " << nu; 
     LOG(INFO) << "Collision type: " << (int) collision;
+    LOG(INFO) << "Transfer scheme: " << (int) transfer;
+    LOG(INFO) << "Interpolation kernel: " << (int) kernel;
+    LOG(INFO) << "Grid layout: " << (int) gridLayout;
     LOG(INFO) << "Visualize: " << (visualize ? "on" : "off");
     LOG(INFO) << "Output file: " << (outputFile ? "on" : "off");
+    LOG(INFO) << "Threads: " << (numThreads > 0 ? std::to_string(numThreads) : "auto");
     if (visualize || outputFile) {
       LOG(INFO) << "Output folder name: " << outFolder;
     }
@@ -134,12 +164,31 @@ public:
   Float spacing = 0.05f;
   /// Collision status 
   CollisionType collision = CollisionType::SLIPPING;
+  /// Transfer scheme
+  TransferScheme transfer = TransferScheme::APIC_FUSED;
+  /// Interpolation kernel, linear for previews, cubic for the smoothest results
+  InterpKernel kernel = InterpKernel::QUADRATIC;
+  /// Grid node storage, sparse for large domains mostly empty of material
+  GridLayout gridLayout = GridLayout::DENSE;
   /// Friction Coefficient
   Float muB = 0.6f;
   /// Whether output simple visualization
   bool visualize = true;
   /// Whether output position and velocity bin file
   bool outputFile = true;
+  /// Number of worker threads, 0 uses all hardware threads
+  int numThreads = 0;
+  /// Particles per work item in parallel G2P, smaller chunks balance better
+  int g2pChunkSize = 256;
+  /// Sort particles by Morton code every this many steps, 0 disables the periodic sort
+  int reorderInterval = 0;
+  /**
+   * Also sort when consecutive particles in memory share a P2G tile for fewer than
+   * this many particles on average, 0 disables the adaptive sort
+   */
+  Float reorderMinRunLength = 8.f;
+  /// Memory budget of the per-step stencil cache in bytes, stencils are recomputed above it
+  size_t stencilCacheBudget = 256 << 20;
   /// Output folder name
   std::string outFolder = "./" + std::to_string(std::time(0));
 };
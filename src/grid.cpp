@@ -1,33 +1,390 @@
 #include "grid.h"
+
+#include <algorithm>
+#include <bitset>
+#include <limits>
+
 #include "util.h"
 
-Grid::Grid(int gridX, int gridY, int gridZ, Float space) :
-  spacing_(space),
-  blocks_(new std::vector<Block>(gridX * gridY * gridZ))
+#if defined(__SSE2__)
+#define MPM_GRID_SSE
+#include <emmintrin.h>
+#endif
+
+Grid::Grid(int gridX, int gridY, int gridZ, Float space, GridLayout layout) :
+  blocks_(nullptr),
+  layout_(layout)
 {
-  size_ << gridX, gridY, gridZ;
+  resize(gridX, gridY, gridZ, space);
 }
 
 Grid::~Grid() {
   delete blocks_;
 }
 
-void Grid::parseLevelSets(const std::vector<uPtr<LevelSet>> &levelSets) {
-  for (int i = 0; i < (*blocks_).size(); i++) {
-    Vec3i idx = getBlockIndex(i);
-    Vec3f blockPos = idx.cast<Float>() * spacing_;
-    Float minSdf = std::numeric_limits<Float>::max();
-    for (const uPtr<LevelSet> &ls : levelSets) {
-      Float sdf = ls->sdf(blockPos);
-      if (sdf < minSdf) minSdf = sdf;
+void Grid::resize(int x, int y, int z, Float spacing) {
+  spacing_ = spacing;
+  size_ << x, y, z;
+  storageSize_ = size_ + Vec3i::Constant(2 * GRID_GHOST);
+  for (int i = 0; i < 3; i++) {
+    tileDim_[i] = (storageSize_[i] + GRID_TILE - 1) / GRID_TILE;
+  }
+  delete blocks_;
+  activeBlocks_.clear();
+  liveTiles_.clear();
+  slotTile_.clear();
+  freeSlots_.clear();
+  tileEpoch_.assign(tileDim_.prod(), 0);
+  epoch_ = 1;
+  if (layout_ == GridLayout::SPARSE) {
+    blocks_ = new AlignedVector<Block>();
+    tileSlot_.assign(tileDim_.prod(), -1);
+  } else if (layout_ == GridLayout::TILED) {
+    blocks_ = new AlignedVector<Block>(tileDim_.prod() * GRID_TILE_NODES);
+    tileSlot_.clear();
+  } else {
+    blocks_ = new AlignedVector<Block>(storageSize_.prod());
+    tileSlot_.clear();
+  }
+  // Without obstacles only the walls bound the domain and no sdf is stored
+  sdf_.assign(hasObstacles() ? (*blocks_).size() : 0, std::numeric_limits<Float>::max());
+  sdfNorm_.assign(sdf_.size(), Vec3f::Zero());
+  // Both dense orders are separable, tiled splits a coordinate into tile and in-tile parts
+  int stride = 1, tileStride = GRID_TILE_NODES, localStride = 1;
+  for (int i = 0; i < 3; i++) {
+    axisOffset_[i].clear();
+    if (layout_ == GridLayout::SPARSE) {
+      continue;
+    }
+    axisOffset_[i].resize(storageSize_[i]);
+    for (int p = 0; p < storageSize_[i]; p++) {
+      axisOffset_[i][p] = layout_ == GridLayout::TILED ?
+          p / GRID_TILE * tileStride + p % GRID_TILE * localStride : p * stride;
+    }
+    stride *= storageSize_[i];
+    tileStride *= tileDim_[i];
+    localStride *= GRID_TILE;
+  }
+}
+
+void Grid::parseLevelSets(const std::vector<uPtr<LevelSet>> &levelSets, ThreadPool *pool) {
+  levelSets_ = &levelSets;
+  movingObstacles_ = false;
+  for (const uPtr<LevelSet> &ls : levelSets) {
+    movingObstacles_ = movingObstacles_ || ls->moving();
+  }
+  sdf_.assign(hasObstacles() ? (*blocks_).size() : 0, std::numeric_limits<Float>::max());
+  sdfNorm_.assign(sdf_.size(), Vec3f::Zero());
+  sdfVel_.assign(movingObstacles_ ? sdf_.size() : 0, Vec3f::Zero());
+  if (!hasObstacles()) {
+    return;
+  }
+  if (layout_ == GridLayout::SPARSE) {
+    std::vector<int> slots;
+    for (int slot = 0; slot < (int)slotTile_.size(); slot++) {
+      if (slotTile_[slot] >= 0) {
+        slots.push_back(slot);
+      }
+    }
+    sampleLevelSets(slots, pool);
+    return;
+  }
+  // z-slabs of the stored nodes, every slab samples one extra layer on each side
+  Vec3i lo = Vec3i::Constant(-GRID_GHOST), hi = size_ + Vec3i::Constant(GRID_GHOST);
+  auto sampleSlabs = [&](int begin, int end) {
+    sampleBox(Vec3i(lo[0], lo[1], lo[2] + begin), Vec3i(hi[0], hi[1], lo[2] + end), -1);
+  };
+  if (pool) {
+    pool->parallelFor(storageSize_[2], 4, sampleSlabs);
+  } else {
+    sampleSlabs(0, storageSize_[2]);
+  }
+}
+
+void Grid::resampleLevelSets(const Vec3f &lo, const Vec3f &hi, ThreadPool *pool) {
+  if (!hasObstacles()) {
+    return;
+  }
+  // Nodes in the collision band read corners up to sqrt(3) * 1.5 cells further, so twice
+  // the band around the box covers every value they see. Beyond it the sdf was and stays
+  // beyond the band
+  const int margin = 2 * COLLIDER_VEL_BAND;
+  Vec3i nodeLo, nodeHi;
+  for (int c = 0; c < 3; c++) {
+    nodeLo[c] = std::max(static_cast<int>(std::floor(lo[c] / spacing_)) - margin, -GRID_GHOST);
+    nodeHi[c] = std::min(static_cast<int>(std::ceil(hi[c] / spacing_)) + margin + 1, size_[c] + GRID_GHOST);
+    if (nodeLo[c] >= nodeHi[c]) {
+      return;
+    }
+  }
+  if (layout_ == GridLayout::SPARSE) {
+    std::vector<int> slots;
+    for (int slot = 0; slot < (int)slotTile_.size(); slot++) {
+      int tile = slotTile_[slot];
+      if (tile < 0) {
+        continue;
+      }
+      Vec3i tileLo(tile % tileDim_[0], tile / tileDim_[0] % tileDim_[1], tile / (tileDim_[0] * tileDim_[1]));
+      tileLo = tileLo * GRID_TILE - Vec3i::Constant(GRID_GHOST);
+      Vec3i tileHi = tileLo + Vec3i::Constant(GRID_TILE);
+      if ((tileLo.array() < nodeHi.array()).all() && (nodeLo.array() < tileHi.array()).all()) {
+        slots.push_back(slot);
+      }
+    }
+    sampleLevelSets(slots, pool);
+    return;
+  }
+  auto sampleSlabs = [&](int begin, int end) {
+    sampleBox(Vec3i(nodeLo[0], nodeLo[1], nodeLo[2] + begin), Vec3i(nodeHi[0], nodeHi[1], nodeLo[2] + end), -1);
+  };
+  if (pool) {
+    pool->parallelFor(nodeHi[2] - nodeLo[2], 4, sampleSlabs);
+  } else {
+    sampleSlabs(0, nodeHi[2] - nodeLo[2]);
+  }
+}
+
+void Grid::sampleBox(const Vec3i &lo, const Vec3i &hi, int slot) {
+  Vec3i dim = hi - lo + Vec3i::Constant(2);
+  const int strideY = dim[0], strideZ = dim[0] * dim[1];
+  // Rows along x, one node further on every side for the central differences
+  std::vector<Float> sdf(dim.prod()), x(dim[0]), y(dim[0]), z(dim[0]), tmp(dim[0]);
+  std::vector<int> which(movingObstacles_ ? dim.prod() : 0);
+  for (int i = 0; i < dim[0]; i++) {
+    x[i] = (lo[0] - 1 + i) * spacing_;
+  }
+  for (int k = 0; k < dim[2]; k++) {
+    for (int j = 0; j < dim[1]; j++) {
+      std::fill(y.begin(), y.end(), (lo[1] - 1 + j) * spacing_);
+      std::fill(z.begin(), z.end(), (lo[2] - 1 + k) * spacing_);
+      int row = j * strideY + k * strideZ;
+      unionSdfBatch(*levelSets_, x.data(), y.data(), z.data(), dim[0], sdf.data() + row, tmp.data(),
+                    movingObstacles_ ? which.data() + row : nullptr);
+    }
+  }
+  Vec3i idx;
+  for (idx[2] = lo[2]; idx[2] < hi[2]; idx[2]++) {
+    for (idx[1] = lo[1]; idx[1] < hi[1]; idx[1]++) {
+      for (idx[0] = lo[0]; idx[0] < hi[0]; idx[0]++) {
+        Vec3i local = idx - lo;
+        int offset;
+        if (slot >= 0) {
+          offset = slot * GRID_TILE_NODES + local[0] + local[1] * GRID_TILE + local[2] * GRID_TILE * GRID_TILE;
+        } else if (isStoredIdx(idx)) {
+          offset = getBlockOffsetUnchecked(idx);
+        } else {
+          continue;
+        }
+        int b = local[0] + 1 + (local[1] + 1) * strideY + (local[2] + 1) * strideZ;
+        sdf_[offset] = sdf[b];
+        // Zero where the level sets are flat
+        Vec3f normal(sdf[b + 1] - sdf[b - 1], sdf[b + strideY] - sdf[b - strideY],
+                     sdf[b + strideZ] - sdf[b - strideZ]);
+        normal.normalize();
+        sdfNorm_[offset] = normal;
+        if (movingObstacles_) {
+          bool near = which[b] >= 0 && sdf[b] <= COLLIDER_VEL_BAND * spacing_;
+          sdfVel_[offset] = near ? (*levelSets_)[which[b]]->velocity(idx.cast<Float>() * spacing_) : Vec3f::Zero();
+        }
+      }
+    }
+  }
+}
+
+void Grid::sampleLevelSets(const std::vector<int> &slots, ThreadPool *pool) {
+  auto sampleRange = [&](int begin, int end) {
+    for (int s = begin; s < end; s++) {
+      int tile = slotTile_[slots[s]];
+      Vec3i lo(tile % tileDim_[0], tile / tileDim_[0] % tileDim_[1], tile / (tileDim_[0] * tileDim_[1]));
+      lo = lo * GRID_TILE - Vec3i::Constant(GRID_GHOST);
+      sampleBox(lo, lo + Vec3i::Constant(GRID_TILE), slots[s]);
+    }
+  };
+  if (pool) {
+    pool->parallelFor(slots.size(), 16, sampleRange);
+  } else {
+    sampleRange(0, slots.size());
+  }
+}
+
+void Grid::prepareTiles(const std::vector<int> &tiles, ThreadPool *pool) {
+  // Every tile needed for the first time this epoch holds an older step
+  std::vector<int> needed;
+  for (int tile : tiles) {
+    int x = tile % tileDim_[0],
+        y = tile / tileDim_[0] % tileDim_[1],
+        z = tile / (tileDim_[0] * tileDim_[1]);
+    for (int nz = std::max(z - 1, 0); nz <= std::min(z + 1, tileDim_[2] - 1); nz++) {
+      for (int ny = std::max(y - 1, 0); ny <= std::min(y + 1, tileDim_[1] - 1); ny++) {
+        for (int nx = std::max(x - 1, 0); nx <= std::min(x + 1, tileDim_[0] - 1); nx++) {
+          int n = nx + ny * tileDim_[0] + nz * tileDim_[0] * tileDim_[1];
+          if (!isLiveTile(n)) {
+            tileEpoch_[n] = epoch_;
+            needed.push_back(n);
+            liveTiles_.push_back(n);
+          }
+        }
+      }
+    }
+  }
+  std::vector<int> newSlots;
+  if (layout_ == GridLayout::SPARSE) {
+    // Release the tiles no particle reaches anymore
+    for (int slot = 0; slot < (int)slotTile_.size(); slot++) {
+      int tile = slotTile_[slot];
+      if (tile >= 0 && !isLiveTile(tile)) {
+        tileSlot_[tile] = -1;
+        slotTile_[slot] = -1;
+        freeSlots_.push_back(slot);
+      }
+    }
+    for (int tile : needed) {
+      if (tileSlot_[tile] >= 0) {
+        continue;
+      }
+      int slot;
+      if (!freeSlots_.empty()) {
+        slot = freeSlots_.back();
+        freeSlots_.pop_back();
+      } else {
+        slot = slotTile_.size();
+        slotTile_.push_back(-1);
+      }
+      tileSlot_[tile] = slot;
+      slotTile_[slot] = tile;
+      newSlots.push_back(slot);
+    }
+    (*blocks_).resize(slotTile_.size() * GRID_TILE_NODES);
+    if (hasObstacles()) {
+      sdf_.resize((*blocks_).size());
+      sdfNorm_.resize((*blocks_).size(), Vec3f::Zero());
+      if (movingObstacles_) {
+        sdfVel_.resize((*blocks_).size(), Vec3f::Zero());
+      }
+    }
+  }
+  pool->parallelFor(needed.size(), 16, [&](int begin, int end) {
+    Vec3i local;
+    for (int t = begin; t < end; t++) {
+      int tile = needed[t];
+      Vec3i origin;
+      origin << tile % tileDim_[0] * GRID_TILE,
+                tile / tileDim_[0] % tileDim_[1] * GRID_TILE,
+                tile / (tileDim_[0] * tileDim_[1]) * GRID_TILE;
+      origin -= Vec3i::Constant(GRID_GHOST);
+      for (int i = 0; i < GRID_TILE_NODES; i++) {
+        local << i % GRID_TILE, i / GRID_TILE % GRID_TILE, i / (GRID_TILE * GRID_TILE);
+        Vec3i idx = origin + local;
+        // Dense tiles at the far end stick out of the stored nodes
+        if (layout_ != GridLayout::DENSE || isStoredIdx(idx)) {
+          (*blocks_)[getBlockOffsetUnchecked(idx)] = Block();
+        }
+      }
+    }
+  });
+  if (hasObstacles()) {
+    sampleLevelSets(newSlots, pool);
+  }
+}
+
+/// Words of the active mask per work item when building the active list
+const static int MASK_WORDS_PER_CHUNK = 64;
+static_assert(GRID_TILE_NODES == 64, "An active mask word must cover exactly one tile");
+
+/// Index of the lowest set bit, mask must not be 0
+static int lowestBit(uint64_t mask) {
+#if defined(__GNUC__) || defined(__clang__)
+  return __builtin_ctzll(mask);
+#else
+  int bit = 0;
+  while (!(mask & 1)) {
+    mask >>= 1;
+    bit++;
+  }
+  return bit;
+#endif
+}
+
+void Grid::buildActiveList(ThreadPool *pool) {
+  // The dense layout only scans the tiles cleared this step, a mask word per tile.
+  // In the tiled layouts a word of storage is one tile, stale ones are skipped whole
+  const bool dense = layout_ == GridLayout::DENSE;
+  int numWords = dense ? liveTiles_.size() : (*blocks_).size() / GRID_TILE_NODES;
+  int numChunks = (numWords + MASK_WORDS_PER_CHUNK - 1) / MASK_WORDS_PER_CHUNK;
+  activeMask_.resize(numWords);
+  chunkStart_.assign(numChunks + 1, 0);
+  // Storage offset of a node of a mask word, -1 past the stored nodes
+  auto wordNode = [&](int w, int bit) {
+    if (!dense) {
+      return w * 64 + bit;
     }
-    (*blocks_)[i].sdf = minSdf;
+    int tile = liveTiles_[w];
+    Vec3i idx;
+    idx << tile % tileDim_[0] * GRID_TILE + bit % GRID_TILE,
+           tile / tileDim_[0] % tileDim_[1] * GRID_TILE + bit / GRID_TILE % GRID_TILE,
+           tile / (tileDim_[0] * tileDim_[1]) * GRID_TILE + bit / (GRID_TILE * GRID_TILE);
+    idx -= Vec3i::Constant(GRID_GHOST);
+    return isStoredIdx(idx) ? getBlockOffsetUnchecked(idx) : -1;
+  };
+  // Mark the nodes with mass and count them per chunk
+  pool->parallelFor(numChunks, 1, [&](int begin, int end) {
+    for (int c = begin; c < end; c++) {
+      int count = 0;
+      int wordEnd = std::min(numWords, (c + 1) * MASK_WORDS_PER_CHUNK);
+      for (int w = c * MASK_WORDS_PER_CHUNK; w < wordEnd; w++) {
+        uint64_t mask = 0;
+        if (layout_ == GridLayout::SPARSE && (slotTile_[w] < 0 || !isLiveTile(slotTile_[w]))) {
+          activeMask_[w] = 0;
+          continue;
+        }
+        if (layout_ == GridLayout::TILED && !isLiveTile(w)) {
+          activeMask_[w] = 0;
+          continue;
+        }
+        for (int bit = 0; bit < 64; bit++) {
+          int i = wordNode(w, bit);
+          if (i < 0) {
+            // Dense tiles at the far end stick out of the stored nodes
+            continue;
+          }
+          Block &block = (*blocks_)[i];
+          if (block.mass != 0.f) {
+            if (!isValidIdx(getBlockIndex(i))) {
+              // Deposits on ghost nodes are dropped, as if the stencil skipped them
+              block = Block();
+              continue;
+            }
+            block.vel /= block.mass;
+            mask |= uint64_t(1) << bit;
+          }
+        }
+        activeMask_[w] = mask;
+        count += std::bitset<64>(mask).count();
+      }
+      chunkStart_[c + 1] = count;
+    }
+  });
+  for (int c = 0; c < numChunks; c++) {
+    chunkStart_[c + 1] += chunkStart_[c];
   }
+  // Every chunk writes its nodes at its prefix sum, so the list keeps the word order
+  activeBlocks_.resize(chunkStart_[numChunks]);
+  pool->parallelFor(numChunks, 1, [&](int begin, int end) {
+    for (int c = begin; c < end; c++) {
+      int out = chunkStart_[c];
+      int wordEnd = std::min(numWords, (c + 1) * MASK_WORDS_PER_CHUNK);
+      for (int w = c * MASK_WORDS_PER_CHUNK; w < wordEnd; w++) {
+        for (uint64_t mask = activeMask_[w]; mask != 0; mask &= mask - 1) {
+          activeBlocks_[out++] = wordNode(w, lowestBit(mask));
+        }
+      }
+    }
+  });
 }
 
 Vec3f Grid::calcMomentum() const {
   Vec3f momentum = Vec3f::Constant(0.f);
-  for (int idx : nonEmptyBlocks_) {
+  for (int idx : activeBlocks_) {
     const Block &block = (*blocks_)[idx];
     momentum += block.vel * block.mass;
   }
@@ -36,7 +393,6 @@ Vec3f Grid::calcMomentum() const {
 
 void Grid::trilinearInterp(const Vec3i &base, const Vec3f &frac, Float *sdf, Vec3f *normal) const {
   Float res = 0.f;
-  Vec3f resNorm = Vec3f::Constant(0.f);
   Float multp[3][2];
   for (int i = 0; i < 3; i++) {
     multp[i][0] = 1 - frac[i];
@@ -51,81 +407,335 @@ void Grid::trilinearInterp(const Vec3i &base, const Vec3f &frac, Float *sdf, Vec
     idx(0) += diffX;
     idx(1) += diffY;
     idx(2) += diffZ;
-    Float s = getBlockAt(idx).sdf;
-    res += s * multp[0][diffX] * multp[1][diffY] * multp[2][diffZ];
-    // Map (0, 1) to (-1, 1)
-    resNorm[0] += s * (diffX * 2 - 1) * multp[1][diffY] * multp[2][diffZ];
-    resNorm[1] += s * multp[0][diffX] * (diffY * 2 - 1) * multp[2][diffZ];
-    resNorm[2] += s * multp[0][diffX] * multp[1][diffY] * (diffZ * 2 - 1);
-  }
-  resNorm.normalize();
+    res += sdf_[getBlockOffsetUnchecked(idx)] * multp[0][diffX] * multp[1][diffY] * multp[2][diffZ];
+  }
+  Vec3i nearest = base;
+  for (int i = 0; i < 3; i++) {
+    nearest[i] += frac[i] >= 0.5f;
+  }
   *sdf = res;
-  *normal = resNorm;
+  *normal = sdfNorm_[getBlockOffsetUnchecked(nearest)];
 }
 
-void Grid::updateGridVel() {
-  profiler.profStart(ProfType::GRID_VEL_UPDATE);
-  Vec3f g; g << 0.f, -9.8f, 0.f;
-  Float maxSpeed = 0.5f * spacing_ / params.timeStep;
-  for (int idx : nonEmptyBlocks_) {
-    Block &block = (*blocks_)[idx];
-    // Add external forces    
-    block.f += block.mass * g;
-    block.vel += block.f * params.timeStep / block.mass;
-    // Set max velocity
-    for (int i = 0; i < 3; i++) {
-      Float v = block.vel(i);
-      if (std::isnan(v)) {
-        block.vel(i) = 0.f;
-      } else if (block.vel(i) > maxSpeed) {
-        block.vel(i) = maxSpeed;
-      } else if (block.vel(i) < - maxSpeed) {
-        block.vel(i) = -maxSpeed;
-      }
-    }
-    // Collision detection
-    Vec3i blockIdx = getBlockIndex(idx);
-    // Block pos in GRID coordinate!
-    Vec3f blockPosHat = blockIdx.cast<Float>() + block.vel * params.timeStep / params.spacing;
-    Vec3i base = floor(blockPosHat);
-    Vec3f frac = blockPosHat - base.cast<Float>();
-    Float sdf;
-    Vec3f normal;
-    trilinearInterp(base, frac, &sdf, &normal);
+/// Active nodes the grid update handles together, a multiple of the SIMD width
+const static int GRID_UPDATE_BATCH = 8;
+
+/// Lane arrays of one grid update batch, one entry per node
+struct GridUpdateLanes {
+  Float vel[3][GRID_UPDATE_BATCH];
+  /// Level set sdf and normal at the advected node
+  Float sdf[GRID_UPDATE_BATCH];
+  Float norm[3][GRID_UPDATE_BATCH];
+  /// Level set sdf at the node itself
+  Float blockSdf[GRID_UPDATE_BATCH];
+  /// Velocity after the collision response
+  Float out[3][GRID_UPDATE_BATCH];
+};
+
+/// Collision settings shared by all lanes
+struct CollisionLaneParams {
+  Float dt;
+  Float muB;
+  bool separating;
+  bool sticky;
+};
+
+/**
+ * Collision response of lanes begin to end, one lane at a time. Follows the
+ * arithmetic of the single node version, selects pick the collision type
+ */
+static void collideLanesScalar(GridUpdateLanes &b, int begin, int end, const CollisionLaneParams &cp) {
+  for (int l = begin; l < end; l++) {
+    Float nx = b.norm[0][l], ny = b.norm[1][l], nz = b.norm[2][l];
     // If sdf > 0, phiHat > 0
     // else if sdf <= 0, phiHat < 0 only if it's "entering" the surface
-    Float phiHat = sdf - std::min(block.sdf, 0.f);
-    if ((params.collision == CollisionType::SEPARATING && phiHat < 0) ||
-        (params.collision == CollisionType::STICKY && block.sdf < 0) ||
-        (params.collision == CollisionType::SLIPPING && block.sdf < 0))
-    {
-      // Collided
-      Vec3f delV = -phiHat * normal / params.timeStep;
-      Vec3f velHat = block.vel + delV;
-      // Tangent component
-      Vec3f vn = normal * normal.dot(velHat);
-      Vec3f vt = velHat - vn;
-      Float vtNorm = vt.norm();
-      if (params.collision == CollisionType::STICKY && vtNorm <= params.muB * vn.norm()) {
-        // Sticky response
-        velHat = Vec3f::Constant(0.f);
-      } else {
-        // Dynamic friction calculation
-        Vec3f tangent = vt.normalized();
-        velHat -= std::min(vtNorm, params.muB * delV.norm()) * tangent;
-      }      
-      block.vel = velHat;
-    }
+    Float phiHat = b.sdf[l] - std::min(b.blockSdf[l], 0.f);
+    bool collided = cp.separating ? phiHat < 0 : b.blockSdf[l] < 0;
+    Float dvx = -phiHat * nx / cp.dt, dvy = -phiHat * ny / cp.dt, dvz = -phiHat * nz / cp.dt;
+    Float hx = b.vel[0][l] + dvx, hy = b.vel[1][l] + dvy, hz = b.vel[2][l] + dvz;
+    Float vnLen = nx * hx + ny * hy + nz * hz;
+    Float vnx = nx * vnLen, vny = ny * vnLen, vnz = nz * vnLen;
+    // Tangent component
+    Float tx = hx - vnx, ty = hy - vny, tz = hz - vnz;
+    Float vtNorm = std::sqrt(tx * tx + ty * ty + tz * tz);
+    Float vnNorm = std::sqrt(vnx * vnx + vny * vny + vnz * vnz);
+    Float delVNorm = std::sqrt(dvx * dvx + dvy * dvy + dvz * dvz);
+    // Sticky response, else dynamic friction along the tangent
+    bool stick = cp.sticky && vtNorm <= cp.muB * vnNorm;
+    Float friction = std::min(vtNorm, cp.muB * delVNorm);
+    Float tLen = vtNorm > 0.f ? vtNorm : 1.f;
+    b.out[0][l] = !collided ? b.vel[0][l] : stick ? 0.f : hx - friction * (tx / tLen);
+    b.out[1][l] = !collided ? b.vel[1][l] : stick ? 0.f : hy - friction * (ty / tLen);
+    b.out[2][l] = !collided ? b.vel[2][l] : stick ? 0.f : hz - friction * (tz / tLen);
+  }
+}
+
+#ifdef MPM_GRID_SSE
+
+/// mask ? a : b
+static inline __m128 selectPs(__m128 mask, __m128 a, __m128 b) {
+  return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+}
+
+static inline __m128 lengthPs(__m128 x, __m128 y, __m128 z) {
+  return _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(x, x), _mm_mul_ps(y, y)), _mm_mul_ps(z, z)));
+}
+
+/**
+ * collideLanesScalar on 4 lanes per instruction, same results bit for bit
+ * @return number of lanes done, the rest is left to the scalar version
+ */
+static int collideLanesSSE(GridUpdateLanes &b, const CollisionLaneParams &cp) {
+  const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.f), dt = _mm_set1_ps(cp.dt),
+               muB = _mm_set1_ps(cp.muB), signBit = _mm_set1_ps(-0.f);
+  const __m128 sticky = cp.sticky ? _mm_cmpeq_ps(zero, zero) : zero;
+  int l = 0;
+  for (; l + 4 <= GRID_UPDATE_BATCH; l += 4) {
+    __m128 nx = _mm_loadu_ps(b.norm[0] + l), ny = _mm_loadu_ps(b.norm[1] + l), nz = _mm_loadu_ps(b.norm[2] + l);
+    __m128 blockSdf = _mm_loadu_ps(b.blockSdf + l);
+    __m128 phiHat = _mm_sub_ps(_mm_loadu_ps(b.sdf + l), _mm_min_ps(blockSdf, zero));
+    __m128 collided = cp.separating ? _mm_cmplt_ps(phiHat, zero) : _mm_cmplt_ps(blockSdf, zero);
+    __m128 negPhi = _mm_xor_ps(phiHat, signBit);
+    __m128 dvx = _mm_div_ps(_mm_mul_ps(negPhi, nx), dt),
+           dvy = _mm_div_ps(_mm_mul_ps(negPhi, ny), dt),
+           dvz = _mm_div_ps(_mm_mul_ps(negPhi, nz), dt);
+    __m128 vx = _mm_loadu_ps(b.vel[0] + l), vy = _mm_loadu_ps(b.vel[1] + l), vz = _mm_loadu_ps(b.vel[2] + l);
+    __m128 hx = _mm_add_ps(vx, dvx), hy = _mm_add_ps(vy, dvy), hz = _mm_add_ps(vz, dvz);
+    __m128 vnLen = _mm_add_ps(_mm_add_ps(_mm_mul_ps(nx, hx), _mm_mul_ps(ny, hy)), _mm_mul_ps(nz, hz));
+    __m128 vnx = _mm_mul_ps(nx, vnLen), vny = _mm_mul_ps(ny, vnLen), vnz = _mm_mul_ps(nz, vnLen);
+    __m128 tx = _mm_sub_ps(hx, vnx), ty = _mm_sub_ps(hy, vny), tz = _mm_sub_ps(hz, vnz);
+    __m128 vtNorm = lengthPs(tx, ty, tz);
+    __m128 stick = _mm_and_ps(sticky, _mm_cmple_ps(vtNorm, _mm_mul_ps(muB, lengthPs(vnx, vny, vnz))));
+    __m128 friction = _mm_min_ps(vtNorm, _mm_mul_ps(muB, lengthPs(dvx, dvy, dvz)));
+    __m128 tLen = selectPs(_mm_cmpgt_ps(vtNorm, zero), vtNorm, one);
+    __m128 rx = _mm_sub_ps(hx, _mm_mul_ps(friction, _mm_div_ps(tx, tLen))),
+           ry = _mm_sub_ps(hy, _mm_mul_ps(friction, _mm_div_ps(ty, tLen))),
+           rz = _mm_sub_ps(hz, _mm_mul_ps(friction, _mm_div_ps(tz, tLen)));
+    _mm_storeu_ps(b.out[0] + l, selectPs(collided, _mm_andnot_ps(stick, rx), vx));
+    _mm_storeu_ps(b.out[1] + l, selectPs(collided, _mm_andnot_ps(stick, ry), vy));
+    _mm_storeu_ps(b.out[2] + l, selectPs(collided, _mm_andnot_ps(stick, rz), vz));
   }
+  return l;
+}
+
+#endif
+
+void Grid::setWalls(int offset) {
+  wallOffset_ = offset;
+}
+
+/**
+ * Velocity of a node colliding with the domain walls, the arithmetic of
+ * collideLanesScalar for a planar sdf. There the sdf change phiHat along the
+ * advection is vn * dt, so the correction removes the normal velocity and
+ * Coulomb friction slows the tangential one. Sticky walls hold the node only
+ * where the tangential velocity is within the friction cone of what is left
+ * @param normal unit normal pointing into the domain
+ */
+static Vec3f wallResponse(const Vec3f &vel, const Vec3f &normal, bool sticky, Float muB) {
+  Vec3f dv = -vel.dot(normal) * normal;
+  Vec3f h = vel + dv;
+  Vec3f vn = normal * normal.dot(h);
+  Vec3f t = h - vn;
+  Float vtNorm = t.norm();
+  if (sticky && vtNorm <= muB * vn.norm()) {
+    return Vec3f::Zero();
+  }
+  Float friction = std::min(vtNorm, muB * dv.norm());
+  return h - friction * (t / (vtNorm > 0.f ? vtNorm : 1.f));
+}
+
+void Grid::updateGridVel(ThreadPool *pool) {
+  profiler.profStart(ProfType::GRID_VEL_UPDATE);
+  const Float g[3] = {0.f, -9.8f, 0.f};
+  const Float dt = params.timeStep;
+  const Float maxSpeed = 0.5f * spacing_ / dt;
+  CollisionLaneParams cp;
+  cp.dt = dt;
+  cp.muB = params.muB;
+  cp.separating = params.collision == CollisionType::SEPARATING;
+  cp.sticky = params.collision == CollisionType::STICKY;
+  const int W = GRID_UPDATE_BATCH;
+  int numBatches = (activeBlocks_.size() + W - 1) / W;
+  // A node moves at most sqrt(3) * maxSpeed * dt and the sdf lookup reaches one cell
+  // further, nodes deeper inside than that can't collide this step
+  const Float band = std::sqrt(3.f) * (maxSpeed * dt + spacing_);
+  const bool obstacles = hasObstacles();
+  const bool moving = movingObstacles_;
+  // Collider velocities are only stored near the surface
+  CHECK(!moving || band <= COLLIDER_VEL_BAND * spacing_) << "Collision band beyond the stored collider velocities";
+  // Walls only need the node index. Like the sdf path, sticky and slipping walls
+  // collide the outer wallOffset_ layers, where the wall sdf is negative. Separating
+  // walls collide by the advected sdf, which also catches the layer on the wall plane
+  // moving into the wall, the only one that can cross it since nodes move at most half
+  // a cell per step
+  const int wallReach = cp.separating ? wallOffset_ : wallOffset_ - 1;
+  auto applyWalls = [&](const int *idx, int count) {
+    if (wallOffset_ < 0) {
+      return;
+    }
+    for (int l = 0; l < count; l++) {
+      Vec3i blockIdx = getBlockIndex(idx[l]);
+      Vec3f normal = Vec3f::Zero();
+      for (int c = 0; c < 3; c++) {
+        normal[c] = (blockIdx[c] <= wallReach) - (blockIdx[c] >= size_[c] - wallReach);
+      }
+      if (normal == Vec3f::Zero()) {
+        continue;
+      }
+      normal.normalize();
+      Block &block = (*blocks_)[idx[l]];
+      // Separating walls let go of nodes leaving the wall
+      if (cp.separating && block.vel.dot(normal) >= 0.f) {
+        continue;
+      }
+      block.vel = wallResponse(block.vel, normal, cp.sticky, params.muB);
+    }
+  };
+  // Each node only writes itself and reads the sdf, which stays constant
+  pool->parallelFor(numBatches, 64, [&](int begin, int end) {
+    GridUpdateLanes b;
+    Float frac[3][W], corner[8][W];
+    Float colliderVel[3][W] = {};
+    for (int batch = begin; batch < end; batch++) {
+      int first = batch * W;
+      int count = std::min(W, (int)activeBlocks_.size() - first);
+      const int *idx = activeBlocks_.data() + first;
+      // Add external forces
+      for (int l = 0; l < count; l++) {
+        Block &block = (*blocks_)[idx[l]];
+        block.f += block.mass * Vec3f(g[0], g[1], g[2]);
+        for (int c = 0; c < 3; c++) {
+          b.vel[c][l] = block.vel[c] + block.f[c] * dt / block.mass;
+        }
+        b.blockSdf[l] = obstacles ? sdf_[idx[l]] : std::numeric_limits<Float>::max();
+      }
+      // Idle lanes of the last batch run on zeros and are never stored
+      for (int l = count; l < W; l++) {
+        for (int c = 0; c < 3; c++) {
+          b.vel[c][l] = 0.f;
+        }
+        b.blockSdf[l] = 0.f;
+      }
+      // Set max velocity, NaN components become 0
+      for (int c = 0; c < 3; c++) {
+        for (int l = 0; l < W; l++) {
+          Float v = std::min(std::max(b.vel[c][l], -maxSpeed), maxSpeed);
+          b.vel[c][l] = b.vel[c][l] != b.vel[c][l] ? 0.f : v;
+        }
+      }
+      // Nodes outside the collision narrow band only need gravity and the clamp
+      bool inBand[W];
+      int numInBand = 0;
+      for (int l = 0; l < count; l++) {
+        inBand[l] = b.blockSdf[l] <= band;
+        numInBand += inBand[l];
+      }
+      if (numInBand == 0) {
+        for (int l = 0; l < count; l++) {
+          (*blocks_)[idx[l]].vel << b.vel[0][l], b.vel[1][l], b.vel[2][l];
+        }
+        applyWalls(idx, count);
+        continue;
+      }
+      // Moving colliders respond to the velocity relative to them
+      if (moving) {
+        for (int l = 0; l < W; l++) {
+          Vec3f vc = l < count && inBand[l] ? sdfVel_[idx[l]] : Vec3f::Zero();
+          for (int c = 0; c < 3; c++) {
+            colliderVel[c][l] = vc[c];
+            b.vel[c][l] -= vc[c];
+          }
+        }
+      }
+      // Level set at the advected node, only the corner lookups are scattered
+      for (int l = 0; l < count; l++) {
+        if (!inBand[l]) {
+          // Zero sdf and normal leave the velocity as is
+          for (int c = 0; c < 3; c++) {
+            frac[c][l] = 0.f;
+            b.norm[c][l] = 0.f;
+          }
+          for (int i = 0; i < 8; i++) {
+            corner[i][l] = 0.f;
+          }
+          continue;
+        }
+        Vec3i blockIdx = getBlockIndex(idx[l]);
+        Vec3i base, nearest;
+        for (int c = 0; c < 3; c++) {
+          // Block pos in GRID coordinate!
+          // The relative velocity of a moving collider is clamped too, so the
+          // lookup stays within the ghost layers
+          Float vHat = std::min(std::max(b.vel[c][l], -maxSpeed), maxSpeed);
+          Float posHat = blockIdx[c] + vHat * dt / params.spacing;
+          base[c] = static_cast<int>(std::floor(posHat));
+          frac[c][l] = posHat - base[c];
+          nearest[c] = base[c] + (frac[c][l] >= 0.5f);
+        }
+        for (int i = 0; i < 8; i++) {
+          Vec3i cornerIdx = base;
+          cornerIdx(0) += i & 1;
+          cornerIdx(1) += (i >> 1) & 1;
+          cornerIdx(2) += (i >> 2) & 1;
+          corner[i][l] = sdf_[getBlockOffsetUnchecked(cornerIdx)];
+        }
+        // The normal of the nearest node stands in for the interpolated one
+        const Vec3f &normal = sdfNorm_[getBlockOffsetUnchecked(nearest)];
+        for (int c = 0; c < 3; c++) {
+          b.norm[c][l] = normal[c];
+        }
+      }
+      for (int l = count; l < W; l++) {
+        for (int c = 0; c < 3; c++) {
+          frac[c][l] = 0.f;
+          b.norm[c][l] = 0.f;
+        }
+        for (int i = 0; i < 8; i++) {
+          corner[i][l] = 0.f;
+        }
+      }
+      // Same arithmetic as trilinearInterp, corners outside and lanes inside
+      Float multp[3][2][W];
+      for (int c = 0; c < 3; c++) {
+        for (int l = 0; l < W; l++) {
+          multp[c][0][l] = 1 - frac[c][l];
+          multp[c][1][l] = frac[c][l];
+        }
+      }
+      for (int l = 0; l < W; l++) {
+        b.sdf[l] = 0.f;
+      }
+      for (int i = 0; i < 8; i++) {
+        int dx = i & 1, dy = (i >> 1) & 1, dz = (i >> 2) & 1;
+        const Float *mx = multp[0][dx], *my = multp[1][dy], *mz = multp[2][dz];
+        for (int l = 0; l < W; l++) {
+          b.sdf[l] += corner[i][l] * mx[l] * my[l] * mz[l];
+        }
+      }
+      int done = 0;
+#ifdef MPM_GRID_SSE
+      done = collideLanesSSE(b, cp);
+#endif
+      collideLanesScalar(b, done, W, cp);
+      if (moving) {
+        for (int c = 0; c < 3; c++) {
+          for (int l = 0; l < W; l++) {
+            b.out[c][l] += colliderVel[c][l];
+          }
+        }
+      }
+      for (int l = 0; l < count; l++) {
+        (*blocks_)[idx[l]].vel << b.out[0][l], b.out[1][l], b.out[2][l];
+      }
+      applyWalls(idx, count);
+    }
+  });
   profiler.profEnd(ProfType::GRID_VEL_UPDATE);
 }
 
 void Grid::reset() {
-  for (int idx : nonEmptyBlocks_) {
-    Block &block = (*blocks_)[idx];
-    block.mass = 0.f;
-    block.vel = Vec3f::Constant(0.f);
-    block.f = Vec3f::Constant(0.f);
-  }
-  nonEmptyBlocks_.clear();
-}
\ No newline at end of file
+  epoch_++;
+  activeBlocks_.clear();
+  liveTiles_.clear();
+}
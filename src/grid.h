@@ -1,15 +1,23 @@
 #pragma once
 
+#include <algorithm>
 #include <array>
 #include <stdexcept>
+#include <cstdint>
 #include <vector>
-#include <unordered_set>
 #include <iostream>
 
 #include "global.h"
+#include "alignedAllocator.h"
 #include "levelSet.h"
+#include "threadPool.h"
 
-struct Block {
+/**
+ * Per-step state of a grid node, what the transfers read and write.
+ * Padded to 32 bytes so a node never straddles a cache line. The static
+ * level set data lives in Grid::sdf_ and Grid::sdfNorm_.
+ */
+struct alignas(32) Block {
   Block() :
     mass(0.f),
     vel(Vec3f::Constant(0.f)),
@@ -19,29 +27,110 @@ struct Block {
   Vec3f vel; 
   /// Block force
   Vec3f f;
-  /// Level set sdf
-  Float sdf;
-  /// Level set normal
-  Vec3f sdfNorm;
 };
 
+/// Edge length of a grid tile in nodes, the unit of sparse allocation
+const static int GRID_TILE = 4;
+/// Nodes per grid tile
+const static int GRID_TILE_NODES = GRID_TILE * GRID_TILE * GRID_TILE;
+/**
+ * Ghost nodes stored around the domain on every side. Stencils of particles
+ * inside the domain and the collision lookup of domain nodes stay within them,
+ * so those accesses need no bounds checks
+ */
+const static int GRID_GHOST = 2;
+/// Cells from a moving level set within which nodes store its velocity in Grid::sdfVel_
+const static int COLLIDER_VEL_BAND = 3;
+
 class Grid {
 public:
-  Grid(int, int, int, Float);
+  Grid(int, int, int, Float, GridLayout layout = GridLayout::DENSE);
   /// Default constructor
   Grid() : blocks_(nullptr) {}
   ~Grid();
+
+  /// Reallocate the grid for a new domain, keeps the layout
+  void resize(int x, int y, int z, Float spacing);
+
+  GridLayout layout() const { return layout_; }
+
+  /// Number of tiles along each axis, tiles cover the ghost nodes too
+  Vec3i tileDim() const { return tileDim_; }
+
+  /// Storage coordinate of a grid index, clamped to the stored nodes
+  Vec3i paddedIdx(const Vec3i &idx) const {
+    Vec3i p;
+    for (int i = 0; i < 3; i++) {
+      p[i] = std::min(std::max(idx[i] + GRID_GHOST, 0), storageSize_[i] - 1);
+    }
+    return p;
+  }
+
+  /// Linear index of the tile holding a grid index, clamped to the stored tiles
+  int tileOf(const Vec3i &idx) const {
+    Vec3i p = paddedIdx(idx);
+    return p[0] / GRID_TILE + p[1] / GRID_TILE * tileDim_[0] + p[2] / GRID_TILE * tileDim_[0] * tileDim_[1];
+  }
   
   /// Take in a list of level sets and compute the sdf and normal at grid nodes.
   /// The values in-between will be interpolated
-  void parseLevelSets(const std::vector<uPtr<LevelSet>> &levelSets);
+  /**
+   * Sample the level sets at the stored nodes. A sparse grid samples tiles as they
+   * are allocated, levelSets must outlive the grid
+   * @param pool samples z-slabs in parallel, may be null
+   */
+  void parseLevelSets(const std::vector<uPtr<LevelSet>> &levelSets, ThreadPool *pool);
+
+  /**
+   * Sample the level sets again near a world box after some of them moved inside it.
+   * Nodes further than the collision band from the box keep their sdf, which stays
+   * beyond the band, and a zero sdfVel_. Needs parseLevelSets first
+   * @param lo, hi box around the old and new bounds of the moved level sets
+   * @param pool samples z-slabs or tiles in parallel, may be null
+   */
+  void resampleLevelSets(const Vec3f &lo, const Vec3f &hi, ThreadPool *pool);
+
+  /**
+   * Bound the domain by axis aligned walls offset nodes in from every domain face.
+   * Nodes collide by their index alone, negative offset removes the walls
+   */
+  void setWalls(int offset);
+
+  /// Whether there are level sets to collide with, only then sdf_ and sdfNorm_ are stored
+  bool hasObstacles() const { return levelSets_ && !levelSets_->empty(); }
+
+  /// Whether a level set moves between steps, only then sdfVel_ is stored
+  bool movingObstacles() const { return movingObstacles_; }
+
+  /**
+   * Ready the tiles around the given tiles for this step, a particle based in
+   * tile t reaches nodes in tiles t-1 to t+1 in P2G, G2P and the collision lookup.
+   * The nodes of those tiles still hold an older step and are cleared here, in parallel.
+   * A sparse grid also allocates them and releases the tiles no longer listed or next to a listed tile.
+   * Call once per step, before the first grid access after reset
+   * @param tiles linear indices of the tiles holding stencil base nodes
+   */
+  void prepareTiles(const std::vector<int> &tiles, ThreadPool *pool);
 
-  /// Update grid velocity
-  void updateGridVel();
+  /**
+   * Turn the momentum deposited by P2G into velocity and collect the nodes with
+   * mass into activeBlocks_, with a parallel bitmask scan and prefix sum compaction.
+   * Only the tiles cleared by prepareTiles this step are scanned
+   */
+  void buildActiveList(ThreadPool *pool);
+
+  /**
+   * Update grid velocity of the active nodes in parallel. Nodes go through in
+   * batches, clamping and the collision response use selects instead of branches
+   */
+  void updateGridVel(ThreadPool *pool);
 
   Vec3f calcMomentum() const;
 
-  /// Clear grid force, mass and velocity
+  /**
+   * Start a new step in O(1). Every tile turns stale and counts as empty until
+   * prepareTiles clears it, no node is touched here
+   */
   void reset();
 
   /**
@@ -55,22 +144,73 @@ public:
            idx[2] < size_[2] && idx[2] >= 0;
   }
 
+  /// Check whether a grid index is stored, inside the domain or in the ghost layer
+  bool isStoredIdx(const Vec3i &idx) const {
+    return idx[0] < size_[0] + GRID_GHOST && idx[0] >= -GRID_GHOST &&
+           idx[1] < size_[1] + GRID_GHOST && idx[1] >= -GRID_GHOST &&
+           idx[2] < size_[2] + GRID_GHOST && idx[2] >= -GRID_GHOST;
+  }
+
+  /**
+   * Check whether all width^3 nodes from base on are stored, then the stencil
+   * can use the unchecked accessors
+   */
+  bool isStoredStencil(const Vec3i &base, int width) const {
+    return isStoredIdx(base) && isStoredIdx(base + Vec3i::Constant(width - 1));
+  }
+
+  /// Grid index of a storage offset, ghost nodes have indices outside the domain
   Vec3i getBlockIndex(int idx) const {
     Vec3i i;
-    int z = idx / (size_[0] * size_[1]);
-    int xy = idx % (size_[0] * size_[1]);
-    int y = xy / size_[0];
-    int x = xy % size_[0];
+    if (layout_ != GridLayout::DENSE) {
+      int tile = layout_ == GridLayout::SPARSE ? slotTile_[idx / GRID_TILE_NODES] : idx / GRID_TILE_NODES;
+      int local = idx % GRID_TILE_NODES;
+      i << tile % tileDim_[0] * GRID_TILE + local % GRID_TILE,
+           tile / tileDim_[0] % tileDim_[1] * GRID_TILE + local / GRID_TILE % GRID_TILE,
+           tile / (tileDim_[0] * tileDim_[1]) * GRID_TILE + local / (GRID_TILE * GRID_TILE);
+      return i - Vec3i::Constant(GRID_GHOST);
+    }
+    int z = idx / (storageSize_[0] * storageSize_[1]);
+    int xy = idx % (storageSize_[0] * storageSize_[1]);
+    int y = xy / storageSize_[0];
+    int x = xy % storageSize_[0];
     i << x, y, z;
-    return i;
+    return i - Vec3i::Constant(GRID_GHOST);
   }
 
+  /// Storage offset of a grid index inside the domain
   int getBlockOffset(const Vec3i &idx) const {
     CHECK(isValidIdx(idx)) << "getBlockAt idx out of range: " << idx[0] << " " << idx[1] << " " << idx[2];
-    return idx[0] + idx[1] * size_[0] + idx[2] * size_[0] * size_[1];
+    return getBlockOffsetUnchecked(idx);
+  }
+
+  /**
+   * Storage offset of a stored grid index, without bounds checks.
+   * Build with MPM_GRID_CHECK to validate every call.
+   * The tile must be allocated for a sparse grid, a tiled grid stores tile t in slot t
+   */
+  int getBlockOffsetUnchecked(const Vec3i &idx) const {
+#ifdef MPM_GRID_CHECK
+    CHECK(isStoredIdx(idx)) << "Grid idx not stored: " << idx[0] << " " << idx[1] << " " << idx[2];
+#endif
+    Vec3i p = idx + Vec3i::Constant(GRID_GHOST);
+    if (layout_ == GridLayout::SPARSE) {
+      int tile = p[0] / GRID_TILE + p[1] / GRID_TILE * tileDim_[0] +
+                 p[2] / GRID_TILE * tileDim_[0] * tileDim_[1];
+      int slot = tileSlot_[tile];
+#ifdef MPM_GRID_CHECK
+      CHECK(slot >= 0) << "Grid tile " << tile << " is not allocated";
+#endif
+      return slot * GRID_TILE_NODES + p[0] % GRID_TILE +
+             (p[1] % GRID_TILE) * GRID_TILE + (p[2] % GRID_TILE) * GRID_TILE * GRID_TILE;
+    }
+    return axisOffset_[0][p[0]] + axisOffset_[1][p[1]] + axisOffset_[2][p[2]];
   }
 
-  /// Get sdf and normal at a point
+  /**
+   * Get sdf and normal at a point, the sdf is interpolated and the normal
+   * is the one stored at the nearest node. Needs obstacles
+   */
   void trilinearInterp(const Vec3i &base, const Vec3f &frac, Float *sdf, Vec3f *normal) const;
 
   Block &getBlockAt(const Vec3i &idx) {
@@ -78,12 +218,80 @@ public:
   }
 
   const Block &getBlockAt(const Vec3i &idx) const {
-    return (*blocks_).at(getBlockOffset(idx));
+    return (*blocks_)[getBlockOffset(idx)];
+  }
+
+  /// Block at a stored grid index, without bounds checks
+  Block &getBlockAtUnchecked(const Vec3i &idx) {
+    return (*blocks_)[getBlockOffsetUnchecked(idx)];
   }
 
   Float spacing_;
   Vec3i size_;
-  std::vector<Block>* blocks_;
-  /// The node with non-zero mass
-  std::unordered_set<int> nonEmptyBlocks_;
+  /// Node storage, indexed by getBlockOffset. A sparse grid stores allocated tiles only,
+  /// a tiled grid pads the domain to whole tiles
+  AlignedVector<Block>* blocks_;
+  /// Level set sdf of every node, same indexing as blocks_. Empty without obstacles
+  AlignedVector<Float> sdf_;
+  /// Level set normal of every node, same indexing as blocks_. Central differences
+  /// of the level sets, sampled together with sdf_
+  AlignedVector<Vec3f> sdfNorm_;
+  /**
+   * Velocity of the nearest level set at the nodes within COLLIDER_VEL_BAND cells of its
+   * surface, zero further away. Covers the collision band of updateGridVel, the only
+   * nodes reading it. Same indexing as blocks_, empty unless a level set moves
+   */
+  AlignedVector<Vec3f> sdfVel_;
+  /// Offsets of the nodes with non-zero mass, grouped by tile
+  std::vector<int> activeBlocks_;
+
+private:
+  /**
+   * Sample the sdf and normal of the level sets at the nodes lo to hi - 1,
+   * and the collider velocity if a level set moves
+   * @param slot sparse storage slot if the box is its tile, else -1 to
+   *             sample the stored nodes of the box
+   */
+  void sampleBox(const Vec3i &lo, const Vec3i &hi, int slot);
+
+  /// Whether a tile was cleared in the current epoch
+  bool isLiveTile(int tile) const { return tileEpoch_[tile] == epoch_; }
+
+  /**
+   * Sample the level sets at the nodes of newly allocated tiles
+   * @param slots storage slots of the tiles
+   * @param pool runs the sampling in parallel, may be null
+   */
+  void sampleLevelSets(const std::vector<int> &slots, ThreadPool *pool);
+
+  GridLayout layout_ = GridLayout::DENSE;
+  /// Stored nodes along each axis, size_ plus the ghost layers
+  Vec3i storageSize_ = Vec3i::Zero();
+  Vec3i tileDim_ = Vec3i::Zero();
+  /**
+   * Offset contributed by each storage coordinate along each axis, the offset of
+   * a node is the sum of its three entries. Dense and tiled layouts only
+   */
+  std::vector<int> axisOffset_[3];
+  /// Wall thickness in nodes, -1 without walls
+  int wallOffset_ = -1;
+  /// Level sets sampled into newly allocated tiles
+  const std::vector<uPtr<LevelSet>> *levelSets_ = nullptr;
+  bool movingObstacles_ = false;
+  /// Storage slot of every tile, -1 if not allocated. Sparse only
+  std::vector<int> tileSlot_;
+  /// Tile of every storage slot, -1 if free. Sparse only
+  std::vector<int> slotTile_;
+  /// Released storage slots
+  std::vector<int> freeSlots_;
+  /// Epoch in which each tile was last cleared, the nodes of older tiles are stale
+  std::vector<int> tileEpoch_;
+  /// Current epoch, advanced by reset
+  int epoch_ = 1;
+  /// Tiles cleared in the current epoch
+  std::vector<int> liveTiles_;
+  /// One bit per node, set for nodes with mass
+  std::vector<uint64_t> activeMask_;
+  /// Start of each compaction chunk in activeBlocks_, one more entry than the chunk count
+  std::vector<int> chunkStart_;
 };
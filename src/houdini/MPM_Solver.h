@@ -42,6 +42,13 @@
 
 // Simulation
 #define MPM_TIMESTEP "timestep"
+#define MPM_THREADS "threads"
+// Interpolation kernel
+#define MPM_KERNEL "kernel"
+// Transfer scheme
+#define MPM_TRANSFER "transfer"
+// Grid node storage
+#define MPM_GRID_LAYOUT "gridlayout"
 
 // Collision
 #define MPM_COLLISION_OBJECT "CollisionObject"
@@ -89,6 +96,10 @@ public:
 	GETSET_DATA_FUNCS_V3(MPM_BBOXMAX, BBoxMax);
 
 	GETSET_DATA_FUNCS_F(MPM_TIMESTEP, Timestep);
+	GETSET_DATA_FUNCS_I(MPM_THREADS, Threads);
+	GETSET_DATA_FUNCS_I(MPM_KERNEL, Kernel);
+	GETSET_DATA_FUNCS_I(MPM_TRANSFER, Transfer);
+	GETSET_DATA_FUNCS_I(MPM_GRID_LAYOUT, GridLayout);
 
 	GETSET_DATA_FUNCS_I(MPM_MATERIAL, Material);
 
@@ -129,6 +140,11 @@ private:
 
 	bool checkValidLocalPosition(Vec3f pos, float threshold);
 
+	// Worker threads kept across solves, every solve builds a new Engine on them
+	sPtr<ThreadPool> pool;
+	// Thread count the pool was created for
+	int poolThreads = -1;
+
 };
 
 #endif
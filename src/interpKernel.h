@@ -0,0 +1,105 @@
+#pragma once
+
+#include <cmath>
+
+#include "global.h"
+
+/*
+ * Interpolation kernels used by the particle-grid transfers. A kernel has a
+ * compile time stencil width and evaluates the weights along one axis, the
+ * weight of a grid node is the product of its three axis weights.
+ *
+ * baseNode(x) is the lowest stencil node of a coordinate in grid units.
+ * eval(x, weight, weightDeriv) fills the weights and derivatives of nodes
+ * base .. base + width - 1 and returns base.
+ */
+
+/// Linear (tent) kernel, 2x2x2 nodes
+struct LinearKernel {
+  static constexpr int width = 2;
+  static constexpr InterpKernel type = InterpKernel::LINEAR;
+
+  static int baseNode(Float x) { return static_cast<int>(std::floor(x)); }
+
+  static int eval(Float x, Float *weight, Float *weightDeriv) {
+    int base = baseNode(x);
+    Float d = x - base;
+    // 0 <= d < 1
+    weight[0] = 1.f - d;
+    weightDeriv[0] = -1.f;
+    weight[1] = d;
+    weightDeriv[1] = 1.f;
+    return base;
+  }
+
+  /**
+   * APIC D^-1 times h^2. D is f * (1 - f) * h^2 along each axis for this kernel, f the
+   * fraction of the cell, so it varies with the position and is singular at the nodes.
+   * 4 is the inverse at the cell center, the bound APIC uses. MLS needs the exact inverse
+   * and rejects this kernel
+   */
+  static Float dInv() { return 4.f; }
+};
+
+/// Quadratic B-spline kernel, 3x3x3 nodes
+struct QuadraticKernel {
+  static constexpr int width = 3;
+  static constexpr InterpKernel type = InterpKernel::QUADRATIC;
+
+  /// Same operations as quadWeight and quadWeightBatch, the results match bit for bit
+  static int baseNode(Float x) { return static_cast<int>(std::floor(x - 0.5f)); }
+
+  static int eval(Float x, Float *weight, Float *weightDeriv) {
+    int base = baseNode(x);
+    Float d = x - base;
+    // 0.5 <= d < 1.5
+    weight[0] = 0.5f * (1.5f - d) * (1.5f - d);
+    weightDeriv[0] = d - 1.5f;
+    d -= 1.f;
+    // -0.5 <= d < 0.5
+    weight[1] = 0.75f - d * d;
+    weightDeriv[1] = -2.f * d;
+    d -= 1.f;
+    // -1.5 <= d < -0.5
+    weight[2] = 0.5f * (1.5f + d) * (1.5f + d);
+    weightDeriv[2] = d + 1.5f;
+    return base;
+  }
+
+  /// APIC D^-1 times h^2
+  static Float dInv() { return 4.f; }
+};
+
+/// Cubic B-spline kernel, 4x4x4 nodes
+struct CubicKernel {
+  static constexpr int width = 4;
+  static constexpr InterpKernel type = InterpKernel::CUBIC;
+
+  static int baseNode(Float x) { return static_cast<int>(std::floor(x)) - 1; }
+
+  static int eval(Float x, Float *weight, Float *weightDeriv) {
+    int base = baseNode(x);
+    Float d = x - base;
+    // 1 <= d < 2
+    Float t = 2.f - d;
+    weight[0] = t * t * t / 6.f;
+    weightDeriv[0] = -0.5f * t * t;
+    d -= 1.f;
+    // 0 <= d < 1
+    weight[1] = 0.5f * d * d * d - d * d + 2.f / 3.f;
+    weightDeriv[1] = 1.5f * d * d - 2.f * d;
+    d -= 1.f;
+    // -1 <= d < 0
+    weight[2] = -0.5f * d * d * d - d * d + 2.f / 3.f;
+    weightDeriv[2] = -1.5f * d * d - 2.f * d;
+    d -= 1.f;
+    // -2 <= d < -1
+    t = 2.f + d;
+    weight[3] = t * t * t / 6.f;
+    weightDeriv[3] = 0.5f * t * t;
+    return base;
+  }
+
+  /// APIC D^-1 times h^2
+  static Float dInv() { return 3.f; }
+};
@@ -1,5 +1,89 @@
 #include "levelSet.h"
 
+#include <algorithm>
+#include <limits>
+
+#include "weightBatch.h"
+
+#if defined(__SSE2__)
+#define MPM_LEVEL_SET_SSE
+#include <emmintrin.h>
+#endif
+
+// AVX2 gathers are picked at run time like in quadWeightBatch
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define MPM_LEVEL_SET_GATHER
+#include <immintrin.h>
+#endif
+
+void LevelSet::sdfBatch(const Float *x, const Float *y, const Float *z, int count, Float *out) const {
+  for (int i = 0; i < count; i++) {
+    out[i] = sdf(Vec3f(x[i], y[i], z[i]));
+  }
+}
+
+/// Distance between the box of some points and level set bounds, 0 if they overlap
+static Float boxGap(const Vec3f &lo, const Vec3f &hi, const Vec3f &boundLo, const Vec3f &boundHi) {
+  return (boundLo - hi).cwiseMax(lo - boundHi).cwiseMax(0.f).norm();
+}
+
+/// Bounding box of count points
+static void pointBox(const Float *x, const Float *y, const Float *z, int count, Vec3f &lo, Vec3f &hi) {
+  lo = Vec3f::Constant(std::numeric_limits<Float>::max());
+  hi = -lo;
+  for (int i = 0; i < count; i++) {
+    Vec3f p(x[i], y[i], z[i]);
+    lo = lo.cwiseMin(p);
+    hi = hi.cwiseMax(p);
+  }
+}
+
+/**
+ * Gaps between the points and the bounds of every level set, nearest first.
+ * Unbounded level sets have gap 0
+ */
+static void sortByGap(const std::vector<uPtr<LevelSet>> &levelSets, const Vec3f &lo, const Vec3f &hi,
+                      std::vector<std::pair<Float, int>> &order) {
+  order.resize(levelSets.size());
+  for (int n = 0; n < (int)levelSets.size(); n++) {
+    Vec3f boundLo, boundHi;
+    bool bounded = levelSets[n]->bounds(boundLo, boundHi);
+    order[n] = std::make_pair(bounded ? boxGap(lo, hi, boundLo, boundHi) : 0.f, n);
+  }
+  std::sort(order.begin(), order.end());
+}
+
+void unionSdfBatch(const std::vector<uPtr<LevelSet>> &levelSets, const Float *x, const Float *y,
+                   const Float *z, int count, Float *out, Float *tmp, int *which) {
+  Vec3f lo, hi;
+  pointBox(x, y, z, count, lo, hi);
+  std::vector<std::pair<Float, int>> order;
+  sortByGap(levelSets, lo, hi, order);
+  std::fill(out, out + count, std::numeric_limits<Float>::max());
+  if (which) {
+    std::fill(which, which + count, -1);
+  }
+  Float maxSdf = std::numeric_limits<Float>::max();
+  for (const std::pair<Float, int> &o : order) {
+    // Points outside the bounds are outside the level set, at least gap away.
+    // The rest is further still
+    if (o.first > 0.f && o.first >= maxSdf) {
+      break;
+    }
+    levelSets[o.second]->sdfBatch(x, y, z, count, tmp);
+    if (which) {
+      for (int i = 0; i < count; i++) {
+        which[i] = tmp[i] < out[i] ? o.second : which[i];
+      }
+    }
+    maxSdf = std::numeric_limits<Float>::lowest();
+    for (int i = 0; i < count; i++) {
+      out[i] = std::min(out[i], tmp[i]);
+      maxSdf = std::max(maxSdf, out[i]);
+    }
+  }
+}
+
 Sphere::Sphere(const Vec3f &center, Float radius) : center_(center), radius_(radius) {}
 
 Float Sphere::sdf(const Vec3f &xi) const {
@@ -7,6 +91,31 @@ Float Sphere::sdf(const Vec3f &xi) const {
   return d.norm() - radius_;
 }
 
+void Sphere::sdfBatch(const Float *x, const Float *y, const Float *z, int count, Float *out) const {
+  int i = 0;
+#ifdef MPM_LEVEL_SET_SSE
+  const __m128 cx = _mm_set1_ps(center_[0]), cy = _mm_set1_ps(center_[1]), cz = _mm_set1_ps(center_[2]),
+               r = _mm_set1_ps(radius_);
+  for (; i + 4 <= count; i += 4) {
+    __m128 dx = _mm_sub_ps(_mm_loadu_ps(x + i), cx);
+    __m128 dy = _mm_sub_ps(_mm_loadu_ps(y + i), cy);
+    __m128 dz = _mm_sub_ps(_mm_loadu_ps(z + i), cz);
+    // Same order as Eigen's norm
+    __m128 sq = _mm_add_ps(_mm_mul_ps(dx, dx), _mm_add_ps(_mm_mul_ps(dy, dy), _mm_mul_ps(dz, dz)));
+    _mm_storeu_ps(out + i, _mm_sub_ps(_mm_sqrt_ps(sq), r));
+  }
+#endif
+  for (; i < count; i++) {
+    out[i] = Sphere::sdf(Vec3f(x[i], y[i], z[i]));
+  }
+}
+
+bool Sphere::bounds(Vec3f &lo, Vec3f &hi) const {
+  lo = center_ - Vec3f::Constant(radius_);
+  hi = center_ + Vec3f::Constant(radius_);
+  return true;
+}
+
 Box::Box(const Vec3f &center, const Vec3f &bound) : center_(center), bound_(bound) {}
 
 Float Box::sdf(const Vec3f &xi) const {
@@ -14,20 +123,598 @@ Float Box::sdf(const Vec3f &xi) const {
   return -(q.cwiseMax(0.f).norm() + std::min(q.maxCoeff(), 0.f));
 }
 
-SDF::SDF(const Vec3i & res) : res_(res)
+void Box::sdfBatch(const Float *x, const Float *y, const Float *z, int count, Float *out) const {
+  int i = 0;
+#ifdef MPM_LEVEL_SET_SSE
+  const __m128 zero = _mm_setzero_ps(), absMask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+  const __m128 c[3] = {_mm_set1_ps(center_[0]), _mm_set1_ps(center_[1]), _mm_set1_ps(center_[2])};
+  const __m128 b[3] = {_mm_set1_ps(bound_[0]), _mm_set1_ps(bound_[1]), _mm_set1_ps(bound_[2])};
+  const Float *p[3] = {x, y, z};
+  for (; i + 4 <= count; i += 4) {
+    __m128 q[3], outside[3];
+    for (int k = 0; k < 3; k++) {
+      q[k] = _mm_sub_ps(_mm_and_ps(_mm_sub_ps(_mm_loadu_ps(p[k] + i), c[k]), absMask), b[k]);
+      outside[k] = _mm_max_ps(q[k], zero);
+    }
+    __m128 sq = _mm_add_ps(_mm_mul_ps(outside[0], outside[0]),
+                           _mm_add_ps(_mm_mul_ps(outside[1], outside[1]), _mm_mul_ps(outside[2], outside[2])));
+    __m128 inside = _mm_min_ps(_mm_max_ps(_mm_max_ps(q[0], q[1]), q[2]), zero);
+    // Flip the sign bit for the negation
+    __m128 d = _mm_add_ps(_mm_sqrt_ps(sq), inside);
+    _mm_storeu_ps(out + i, _mm_xor_ps(d, _mm_set1_ps(-0.f)));
+  }
+#endif
+  for (; i < count; i++) {
+    out[i] = Box::sdf(Vec3f(x[i], y[i], z[i]));
+  }
+}
+
+SDF::SDF(const Vec3i & res, Float spacing, const Vec3f & origin, SdfInterp interp) :
+	res_(res),
+	origin_(origin),
+	upper_(origin + (res - Vec3i::Ones()).cast<Float>() * spacing),
+	spacing_(spacing),
+	invSpacing_(1.f / spacing),
+	interp_(interp)
 {
+	CHECK(res.minCoeff() >= 2) << "SDF needs at least 2 voxels along each axis";
 	value_.resize(res.x() * res.y() * res.z());
 }
 
+static inline Float lerp(Float a, Float b, Float t) {
+	return a + (b - a) * t;
+}
 
 Float SDF::sdf(const Vec3f & xi) const
 {
-	// [TODO] Interpolate
-	Vec3i id = (xi / params.spacing).cast<int>();
-	return value_[id.z() * res_.x() * res_.y() + id.y() * res_.x() + id.x()];
+	Vec3f p = xi.cwiseMax(origin_).cwiseMin(upper_);
+	Vec3f d = xi - p;
+	Float outside = std::sqrt(d[0] * d[0] + (d[1] * d[1] + d[2] * d[2]));
+	Vec3f g = (p - origin_) * invSpacing_;
+	return (interp_ == SdfInterp::TRICUBIC ? tricubic(g) : trilinear(g)) + outside;
+}
+
+Float SDF::trilinear(const Vec3f & g) const
+{
+	const int strideY = res_[0], strideZ = res_[0] * res_[1];
+	int i = std::min(static_cast<int>(g[0]), res_[0] - 2),
+	    j = std::min(static_cast<int>(g[1]), res_[1] - 2),
+	    k = std::min(static_cast<int>(g[2]), res_[2] - 2);
+	Float fx = g[0] - i, fy = g[1] - j, fz = g[2] - k;
+	const Float *v = &value_[i + j * strideY + k * strideZ];
+	Float c00 = lerp(v[0], v[1], fx), c10 = lerp(v[strideY], v[strideY + 1], fx),
+	      c01 = lerp(v[strideZ], v[strideZ + 1], fx),
+	      c11 = lerp(v[strideY + strideZ], v[strideY + strideZ + 1], fx);
+	return lerp(lerp(c00, c10, fy), lerp(c01, c11, fy), fz);
+}
+
+/// Catmull-Rom weights of the voxels at -1, 0, 1 and 2 for a fraction t
+static inline void catmullRom(Float t, Float *w) {
+	w[0] = ((2.f - t) * t - 1.f) * t * 0.5f;
+	w[1] = ((3.f * t - 5.f) * t * t + 2.f) * 0.5f;
+	w[2] = ((4.f - 3.f * t) * t + 1.f) * t * 0.5f;
+	w[3] = (t - 1.f) * t * t * 0.5f;
+}
+
+Float SDF::tricubic(const Vec3f & g) const
+{
+	int base[3], idx[3][4];
+	Float w[3][4];
+	for (int c = 0; c < 3; c++) {
+		base[c] = std::min(static_cast<int>(g[c]), res_[c] - 2);
+		catmullRom(g[c] - base[c], w[c]);
+		// Clamp the outer voxels at the volume border
+		for (int n = 0; n < 4; n++) {
+			idx[c][n] = std::min(std::max(base[c] - 1 + n, 0), res_[c] - 1);
+		}
+	}
+	Float result = 0.f;
+	for (int k = 0; k < 4; k++) {
+		Float slice = 0.f;
+		for (int j = 0; j < 4; j++) {
+			const Float *row = &value_[(idx[2][k] * res_[1] + idx[1][j]) * res_[0]];
+			Float line = 0.f;
+			for (int i = 0; i < 4; i++) {
+				line += w[0][i] * row[idx[0][i]];
+			}
+			slice += w[1][j] * line;
+		}
+		result += w[2][k] * slice;
+	}
+	return result;
+}
+
+#ifdef MPM_LEVEL_SET_GATHER
+
+__attribute__((target("avx2")))
+static inline __m256 lerpPs(__m256 a, __m256 b, __m256 t) {
+	return _mm256_add_ps(a, _mm256_mul_ps(_mm256_sub_ps(b, a), t));
+}
+
+/**
+ * SDF::sdf of trilinear volumes for 8 points per instruction, same results bit for bit
+ * @return number of points done, the rest is left to the scalar version
+ */
+__attribute__((target("avx2")))
+static int sdfTrilinearAVX2(const Float *value, const Vec3i &res, const Vec3f &origin, const Vec3f &upper,
+                            Float invSpacing, const Float *x, const Float *y, const Float *z, int count, Float *out) {
+	const Float *pos[3] = {x, y, z};
+	const __m256 inv = _mm256_set1_ps(invSpacing);
+	const __m256i strideY = _mm256_set1_epi32(res[0]), strideZ = _mm256_set1_epi32(res[0] * res[1]),
+	              one = _mm256_set1_epi32(1);
+	int p = 0;
+	for (; p + 8 <= count; p += 8) {
+		__m256 d[3], f[3];
+		__m256i base[3];
+		for (int c = 0; c < 3; c++) {
+			__m256 xi = _mm256_loadu_ps(pos[c] + p);
+			__m256 lo = _mm256_set1_ps(origin[c]);
+			__m256 clamped = _mm256_min_ps(_mm256_max_ps(xi, lo), _mm256_set1_ps(upper[c]));
+			d[c] = _mm256_sub_ps(xi, clamped);
+			__m256 g = _mm256_mul_ps(_mm256_sub_ps(clamped, lo), inv);
+			base[c] = _mm256_min_epi32(_mm256_cvttps_epi32(g), _mm256_set1_epi32(res[c] - 2));
+			f[c] = _mm256_sub_ps(g, _mm256_cvtepi32_ps(base[c]));
+		}
+		__m256 outside = _mm256_sqrt_ps(_mm256_add_ps(_mm256_mul_ps(d[0], d[0]),
+		    _mm256_add_ps(_mm256_mul_ps(d[1], d[1]), _mm256_mul_ps(d[2], d[2]))));
+		__m256i i000 = _mm256_add_epi32(base[0], _mm256_add_epi32(_mm256_mullo_epi32(base[1], strideY),
+		                                                          _mm256_mullo_epi32(base[2], strideZ)));
+		__m256i i010 = _mm256_add_epi32(i000, strideY), i001 = _mm256_add_epi32(i000, strideZ),
+		        i011 = _mm256_add_epi32(i010, strideZ);
+		__m256 c00 = lerpPs(_mm256_i32gather_ps(value, i000, 4),
+		                    _mm256_i32gather_ps(value, _mm256_add_epi32(i000, one), 4), f[0]);
+		__m256 c10 = lerpPs(_mm256_i32gather_ps(value, i010, 4),
+		                    _mm256_i32gather_ps(value, _mm256_add_epi32(i010, one), 4), f[0]);
+		__m256 c01 = lerpPs(_mm256_i32gather_ps(value, i001, 4),
+		                    _mm256_i32gather_ps(value, _mm256_add_epi32(i001, one), 4), f[0]);
+		__m256 c11 = lerpPs(_mm256_i32gather_ps(value, i011, 4),
+		                    _mm256_i32gather_ps(value, _mm256_add_epi32(i011, one), 4), f[0]);
+		__m256 result = lerpPs(lerpPs(c00, c10, f[1]), lerpPs(c01, c11, f[1]), f[2]);
+		_mm256_storeu_ps(out + p, _mm256_add_ps(result, outside));
+	}
+	return p;
+}
+
+#endif
+
+void SDF::sdfBatch(const Float * x, const Float * y, const Float * z, int count, Float * out) const
+{
+	int done = 0;
+#ifdef MPM_LEVEL_SET_GATHER
+	if (interp_ == SdfInterp::TRILINEAR && detectSimdLevel() >= SimdLevel::AVX2) {
+		done = sdfTrilinearAVX2(value_.data(), res_, origin_, upper_, invSpacing_, x, y, z, count, out);
+	}
+#endif
+	for (int i = done; i < count; i++) {
+		out[i] = SDF::sdf(Vec3f(x[i], y[i], z[i]));
+	}
 }
 
 void SDF::setSdf(const Vec3i & xi, Float v)
 {
 	value_[xi.z() * res_.x() * res_.y() + xi.y() * res_.x() + xi.x()] = v;
 }
+
+NarrowBandSDF::NarrowBandSDF(const SDF &volume, Float band) :
+  res_(volume.res()),
+  origin_(volume.origin()),
+  upper_(volume.origin() + (volume.res() - Vec3i::Ones()).cast<Float>() * volume.spacing()),
+  invSpacing_(1.f / volume.spacing())
+{
+  CHECK(band >= volume.spacing()) << "Narrow band thinner than a voxel";
+  // Tiles hold the cells, one less than the voxels along each axis
+  tileDim_ = (res_ - Vec3i::Ones() + Vec3i::Constant(SDF_TILE - 1)) / SDF_TILE;
+  tileSlot_.assign(tileDim_.prod(), -1);
+  farValue_.assign(tileDim_.prod(), band);
+  std::vector<Float> values(TILE_VALUES);
+  Vec3i t;
+  for (t[2] = 0; t[2] < tileDim_[2]; t[2]++) {
+    for (t[1] = 0; t[1] < tileDim_[1]; t[1]++) {
+      for (t[0] = 0; t[0] < tileDim_[0]; t[0]++) {
+        bool inBand = false, inside = false;
+        Vec3i local;
+        int n = 0;
+        for (local[2] = 0; local[2] <= SDF_TILE; local[2]++) {
+          for (local[1] = 0; local[1] <= SDF_TILE; local[1]++) {
+            for (local[0] = 0; local[0] <= SDF_TILE; local[0]++) {
+              // The last tiles reach past the volume, their extra voxels are never read
+              Vec3i voxel = (t * SDF_TILE + local).cwiseMin(res_ - Vec3i::Ones());
+              values[n] = volume.getSdf(voxel);
+              inBand |= std::abs(values[n]) <= band;
+              inside |= values[n] < 0.f;
+              n++;
+            }
+          }
+        }
+        int tile = t[0] + (t[1] + t[2] * tileDim_[1]) * tileDim_[0];
+        if (inBand) {
+          tileSlot_[tile] = bandValue_.size() / TILE_VALUES;
+          bandValue_.insert(bandValue_.end(), values.begin(), values.end());
+        } else if (inside) {
+          farValue_[tile] = -band;
+        }
+      }
+    }
+  }
+  // Far tiles only know the band, so the sdf is below the distance to the surface
+  // anywhere in the volume and the whole volume is the bounds. Outside the volume the
+  // sdf continues from the border, so an inside border leaks out
+  bounded_ = true;
+  Vec3i voxel;
+  for (voxel[2] = 0; voxel[2] < res_[2]; voxel[2]++) {
+    for (voxel[1] = 0; voxel[1] < res_[1]; voxel[1]++) {
+      for (voxel[0] = 0; voxel[0] < res_[0]; voxel[0]++) {
+        bool border = (voxel.array() == 0).any() || (voxel.array() == res_.array() - 1).any();
+        if (border && volume.getSdf(voxel) <= 0.f) {
+          bounded_ = false;
+        }
+      }
+    }
+  }
+}
+
+Float NarrowBandSDF::sdf(const Vec3f &xi) const {
+  Vec3f p = xi.cwiseMax(origin_).cwiseMin(upper_);
+  Vec3f d = xi - p;
+  Float outside = std::sqrt(d[0] * d[0] + (d[1] * d[1] + d[2] * d[2]));
+  Vec3f g = (p - origin_) * invSpacing_;
+  Vec3i base, t;
+  Vec3f f;
+  for (int c = 0; c < 3; c++) {
+    base[c] = std::min(static_cast<int>(g[c]), res_[c] - 2);
+    f[c] = g[c] - base[c];
+    t[c] = base[c] / SDF_TILE;
+  }
+  int tile = t[0] + (t[1] + t[2] * tileDim_[1]) * tileDim_[0];
+  int slot = tileSlot_[tile];
+  if (slot < 0) {
+    return farValue_[tile] + outside;
+  }
+  const int strideY = SDF_TILE + 1, strideZ = strideY * strideY;
+  Vec3i local = base - t * SDF_TILE;
+  const Float *v = &bandValue_[slot * TILE_VALUES + local[0] + local[1] * strideY + local[2] * strideZ];
+  Float c00 = lerp(v[0], v[1], f[0]), c10 = lerp(v[strideY], v[strideY + 1], f[0]),
+        c01 = lerp(v[strideZ], v[strideZ + 1], f[0]),
+        c11 = lerp(v[strideY + strideZ], v[strideY + strideZ + 1], f[0]);
+  return lerp(lerp(c00, c10, f[1]), lerp(c01, c11, f[1]), f[2]) + outside;
+}
+
+void NarrowBandSDF::sdfBatch(const Float *x, const Float *y, const Float *z, int count, Float *out) const {
+  for (int i = 0; i < count; i++) {
+    out[i] = NarrowBandSDF::sdf(Vec3f(x[i], y[i], z[i]));
+  }
+}
+
+bool NarrowBandSDF::bounds(Vec3f &lo, Vec3f &hi) const {
+  lo = origin_;
+  hi = upper_;
+  return bounded_;
+}
+
+/// Box around the bounds of all children, false if any is unbounded
+static bool unionBounds(const std::vector<uPtr<LevelSet>> &children, Vec3f &lo, Vec3f &hi) {
+  lo = Vec3f::Constant(std::numeric_limits<Float>::max());
+  hi = -lo;
+  for (const uPtr<LevelSet> &child : children) {
+    Vec3f childLo, childHi;
+    if (!child->bounds(childLo, childHi)) {
+      return false;
+    }
+    lo = lo.cwiseMin(childLo);
+    hi = hi.cwiseMax(childHi);
+  }
+  return !children.empty();
+}
+
+/// Child with the smallest sdf at a point, or with the largest if largest is set
+static const LevelSet *pickChild(const std::vector<uPtr<LevelSet>> &children, const Vec3f &xi, bool largest) {
+  const LevelSet *picked = nullptr;
+  Float best = 0.f;
+  for (const uPtr<LevelSet> &child : children) {
+    Float d = child->sdf(xi);
+    if (!picked || (largest ? d > best : d < best)) {
+      picked = child.get();
+      best = d;
+    }
+  }
+  return picked;
+}
+
+static bool anyMoving(const std::vector<uPtr<LevelSet>> &children) {
+  for (const uPtr<LevelSet> &child : children) {
+    if (child->moving()) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static void advanceAll(const std::vector<uPtr<LevelSet>> &children, Float dt) {
+  for (const uPtr<LevelSet> &child : children) {
+    child->advance(dt);
+  }
+}
+
+Union::Union(std::vector<uPtr<LevelSet>> children) : children_(std::move(children)) {
+  updateBounds();
+}
+
+void Union::updateBounds() {
+  bounded_ = unionBounds(children_, lo_, hi_);
+}
+
+Float Union::sdf(const Vec3f &xi) const {
+  Float result = std::numeric_limits<Float>::max();
+  for (const uPtr<LevelSet> &child : children_) {
+    Vec3f lo, hi;
+    if (child->bounds(lo, hi)) {
+      Float gap = boxGap(xi, xi, lo, hi);
+      if (gap > 0.f && gap >= result) {
+        continue;
+      }
+    }
+    result = std::min(result, child->sdf(xi));
+  }
+  return result;
+}
+
+void Union::sdfBatch(const Float *x, const Float *y, const Float *z, int count, Float *out) const {
+  std::vector<Float> tmp(count);
+  unionSdfBatch(children_, x, y, z, count, out, tmp.data());
+}
+
+bool Union::bounds(Vec3f &lo, Vec3f &hi) const {
+  lo = lo_;
+  hi = hi_;
+  return bounded_;
+}
+
+Vec3f Union::velocity(const Vec3f &xi) const {
+  const LevelSet *child = pickChild(children_, xi, false);
+  return child ? child->velocity(xi) : Vec3f::Zero();
+}
+
+bool Union::moving() const {
+  return anyMoving(children_);
+}
+
+void Union::advance(Float dt) {
+  // Keep the bounds around the moved children
+  advanceAll(children_, dt);
+  updateBounds();
+}
+
+Intersection::Intersection(std::vector<uPtr<LevelSet>> children) : children_(std::move(children)) {
+  updateBounds();
+}
+
+void Intersection::updateBounds() {
+  // The sdf is at least each child's, so at least the distance to the box of any
+  // bounded child. The overlap of the boxes is too small, the smallest box is used
+  bounded_ = false;
+  Float volume = std::numeric_limits<Float>::max();
+  for (const uPtr<LevelSet> &child : children_) {
+    Vec3f childLo, childHi;
+    if (child->bounds(childLo, childHi) && (childHi - childLo).prod() < volume) {
+      bounded_ = true;
+      volume = (childHi - childLo).prod();
+      lo_ = childLo;
+      hi_ = childHi;
+    }
+  }
+}
+
+Float Intersection::sdf(const Vec3f &xi) const {
+  Float result = std::numeric_limits<Float>::lowest();
+  for (const uPtr<LevelSet> &child : children_) {
+    result = std::max(result, child->sdf(xi));
+  }
+  return result;
+}
+
+void Intersection::sdfBatch(const Float *x, const Float *y, const Float *z, int count, Float *out) const {
+  std::vector<Float> tmp(count);
+  std::fill(out, out + count, std::numeric_limits<Float>::lowest());
+  for (const uPtr<LevelSet> &child : children_) {
+    child->sdfBatch(x, y, z, count, tmp.data());
+    for (int i = 0; i < count; i++) {
+      out[i] = std::max(out[i], tmp[i]);
+    }
+  }
+}
+
+bool Intersection::bounds(Vec3f &lo, Vec3f &hi) const {
+  lo = lo_;
+  hi = hi_;
+  return bounded_;
+}
+
+Vec3f Intersection::velocity(const Vec3f &xi) const {
+  const LevelSet *child = pickChild(children_, xi, true);
+  return child ? child->velocity(xi) : Vec3f::Zero();
+}
+
+bool Intersection::moving() const {
+  return anyMoving(children_);
+}
+
+void Intersection::advance(Float dt) {
+  advanceAll(children_, dt);
+  updateBounds();
+}
+
+Difference::Difference(uPtr<LevelSet> a, uPtr<LevelSet> b) : a_(std::move(a)), b_(std::move(b)) {}
+
+Float Difference::sdf(const Vec3f &xi) const {
+  return std::max(a_->sdf(xi), -b_->sdf(xi));
+}
+
+void Difference::sdfBatch(const Float *x, const Float *y, const Float *z, int count, Float *out) const {
+  a_->sdfBatch(x, y, z, count, out);
+  Vec3f lo, hi, boundLo, boundHi;
+  if (b_->bounds(boundLo, boundHi)) {
+    // Outside b's bounds -b is at most -gap, so it only matters where a is below that
+    pointBox(x, y, z, count, lo, hi);
+    Float gap = boxGap(lo, hi, boundLo, boundHi);
+    if (gap > 0.f && *std::min_element(out, out + count) >= -gap) {
+      return;
+    }
+  }
+  std::vector<Float> tmp(count);
+  b_->sdfBatch(x, y, z, count, tmp.data());
+  for (int i = 0; i < count; i++) {
+    out[i] = std::max(out[i], -tmp[i]);
+  }
+}
+
+Vec3f Difference::velocity(const Vec3f &xi) const {
+  return a_->sdf(xi) >= -b_->sdf(xi) ? a_->velocity(xi) : b_->velocity(xi);
+}
+
+void Difference::advance(Float dt) {
+  a_->advance(dt);
+  b_->advance(dt);
+}
+
+/// Quadratic smooth minimum, equal to the minimum once a and b are k apart
+static inline Float smoothMin(Float a, Float b, Float k) {
+  Float h = std::max(k - std::abs(a - b), 0.f) / k;
+  return std::min(a, b) - h * h * k * 0.25f;
+}
+
+SmoothUnion::SmoothUnion(std::vector<uPtr<LevelSet>> children, Float k) : children_(std::move(children)), k_(k) {
+  CHECK(k > 0.f) << "Smooth union needs a positive blend width";
+  updateBounds();
+}
+
+void SmoothUnion::updateBounds() {
+  // Every child after the first blends in up to k / 4 below the running result
+  bounded_ = unionBounds(children_, lo_, hi_);
+  Float reach = std::max<int>(children_.size() - 1, 0) * 0.25f * k_;
+  lo_ -= Vec3f::Constant(reach);
+  hi_ += Vec3f::Constant(reach);
+}
+
+Float SmoothUnion::sdf(const Vec3f &xi) const {
+  Float result = std::numeric_limits<Float>::max();
+  for (const uPtr<LevelSet> &child : children_) {
+    Vec3f lo, hi;
+    if (child->bounds(lo, hi) && result < std::numeric_limits<Float>::max()) {
+      // A child k further than the result doesn't change it
+      Float gap = boxGap(xi, xi, lo, hi);
+      if (gap > 0.f && gap >= result + k_) {
+        continue;
+      }
+    }
+    Float d = child->sdf(xi);
+    result = result == std::numeric_limits<Float>::max() ? d : smoothMin(result, d, k_);
+  }
+  return result;
+}
+
+void SmoothUnion::sdfBatch(const Float *x, const Float *y, const Float *z, int count, Float *out) const {
+  // The smooth minimum depends on the order of the children, so unlike the
+  // union they are visited as given and culled against the running result
+  Vec3f lo, hi;
+  pointBox(x, y, z, count, lo, hi);
+  std::vector<Float> tmp(count);
+  bool first = true;
+  Float maxSdf = std::numeric_limits<Float>::max();
+  for (const uPtr<LevelSet> &child : children_) {
+    Vec3f boundLo, boundHi;
+    if (!first && child->bounds(boundLo, boundHi)) {
+      Float gap = boxGap(lo, hi, boundLo, boundHi);
+      if (gap > 0.f && gap >= maxSdf + k_) {
+        continue;
+      }
+    }
+    child->sdfBatch(x, y, z, count, first ? out : tmp.data());
+    maxSdf = std::numeric_limits<Float>::lowest();
+    for (int i = 0; i < count; i++) {
+      if (!first) {
+        out[i] = smoothMin(out[i], tmp[i], k_);
+      }
+      maxSdf = std::max(maxSdf, out[i]);
+    }
+    first = false;
+  }
+}
+
+bool SmoothUnion::bounds(Vec3f &lo, Vec3f &hi) const {
+  lo = lo_;
+  hi = hi_;
+  return bounded_;
+}
+
+Vec3f SmoothUnion::velocity(const Vec3f &xi) const {
+  const LevelSet *child = pickChild(children_, xi, false);
+  return child ? child->velocity(xi) : Vec3f::Zero();
+}
+
+bool SmoothUnion::moving() const {
+  return anyMoving(children_);
+}
+
+void SmoothUnion::advance(Float dt) {
+  advanceAll(children_, dt);
+  updateBounds();
+}
+
+TransformedLevelSet::TransformedLevelSet(uPtr<LevelSet> shape) : shape_(std::move(shape)) {}
+
+Float TransformedLevelSet::sdf(const Vec3f &xi) const {
+  return shape_->sdf(rotation_.transpose() * (xi - translation_));
+}
+
+void TransformedLevelSet::sdfBatch(const Float *x, const Float *y, const Float *z, int count, Float *out) const {
+  // Rigid motions keep distances, only the points move into the shape frame
+  Mat3f inv = rotation_.transpose();
+  std::vector<Float> local(3 * count);
+  Float *lx = local.data(), *ly = lx + count, *lz = ly + count;
+  for (int i = 0; i < count; i++) {
+    Float px = x[i] - translation_[0], py = y[i] - translation_[1], pz = z[i] - translation_[2];
+    lx[i] = inv(0, 0) * px + inv(0, 1) * py + inv(0, 2) * pz;
+    ly[i] = inv(1, 0) * px + inv(1, 1) * py + inv(1, 2) * pz;
+    lz[i] = inv(2, 0) * px + inv(2, 1) * py + inv(2, 2) * pz;
+  }
+  shape_->sdfBatch(lx, ly, lz, count, out);
+}
+
+bool TransformedLevelSet::bounds(Vec3f &lo, Vec3f &hi) const {
+  Vec3f shapeLo, shapeHi;
+  if (!shape_->bounds(shapeLo, shapeHi)) {
+    return false;
+  }
+  lo = Vec3f::Constant(std::numeric_limits<Float>::max());
+  hi = -lo;
+  for (int i = 0; i < 8; i++) {
+    Vec3f corner((i & 1) ? shapeHi[0] : shapeLo[0], (i & 2) ? shapeHi[1] : shapeLo[1],
+                 (i & 4) ? shapeHi[2] : shapeLo[2]);
+    corner = rotation_ * corner + translation_;
+    lo = lo.cwiseMin(corner);
+    hi = hi.cwiseMax(corner);
+  }
+  return true;
+}
+
+Vec3f TransformedLevelSet::velocity(const Vec3f &xi) const {
+  return linearVel_ + angularVel_.cross(xi - translation_);
+}
+
+void TransformedLevelSet::advance(Float dt) {
+  translation_ += linearVel_ * dt;
+  Float angle = angularVel_.norm() * dt;
+  if (angle > 0.f) {
+    rotation_ = Eigen::AngleAxis<Float>(angle, angularVel_.normalized()).toRotationMatrix() * rotation_;
+  }
+}
+
+void TransformedLevelSet::setTransform(const Mat3f &rotation, const Vec3f &translation) {
+  rotation_ = rotation;
+  translation_ = translation;
+}
+
+void TransformedLevelSet::setVelocity(const Vec3f &linear, const Vec3f &angular) {
+  linearVel_ = linear;
+  angularVel_ = angular;
+}
@@ -7,13 +7,50 @@ public:
   LevelSet() {}
   virtual ~LevelSet() {}
   virtual Float sdf(const Vec3f &xi) const = 0;
+
+  /**
+   * sdf of many points in one call, calls sdf per point unless overridden
+   * @param x, y, z point coordinates, count entries each
+   * @param out count entries
+   */
+  virtual void sdfBatch(const Float *x, const Float *y, const Float *z, int count, Float *out) const;
+
+  /**
+   * Axis aligned box holding the surface and the inside. Outside of it the sdf
+   * is at least the distance to the box, so far away points can skip the level set
+   * @return false if there is no such box
+   */
+  virtual bool bounds(Vec3f &lo, Vec3f &hi) const { return false; }
+
+  /// Velocity of the surface nearest to a point, colliders are still unless they move
+  virtual Vec3f velocity(const Vec3f &xi) const { return Vec3f::Zero(); }
+
+  /// Whether the level set moves between steps, the grid then samples it every step
+  virtual bool moving() const { return false; }
+
+  /// Move the level set along its velocity for one step
+  virtual void advance(Float dt) {}
 };
 
+/**
+ * Minimum of level sets at many points. The level sets are visited nearest
+ * bounds first and the ones whose bounds are further from all the points than
+ * their current minimum are skipped
+ * @param out count entries
+ * @param tmp scratch, count entries
+ * @param which if not null, count entries set to the index of the level set
+ *              holding the minimum, -1 where no level set was evaluated
+ */
+void unionSdfBatch(const std::vector<uPtr<LevelSet>> &levelSets, const Float *x, const Float *y,
+                   const Float *z, int count, Float *out, Float *tmp, int *which = nullptr);
+
 class Sphere : public LevelSet {
 public:
   Sphere(const Vec3f &center, Float radius);
   ~Sphere() {}
   virtual Float sdf(const Vec3f &xi) const;
+  virtual void sdfBatch(const Float *x, const Float *y, const Float *z, int count, Float *out) const;
+  virtual bool bounds(Vec3f &lo, Vec3f &hi) const;
 
 private:
   Vec3f center_;
@@ -24,19 +61,209 @@ class Box : public LevelSet {
 public:
   Box(const Vec3f &center, const Vec3f &bound);
   ~Box() {}
+  /// Positive inside the box, the box holds the material
   virtual Float sdf(const Vec3f &xi) const;
+  virtual void sdfBatch(const Float *x, const Float *y, const Float *z, int count, Float *out) const;
 private:
   Vec3f center_;
   Vec3f bound_;
 };
 
+/// Sampling of an SDF volume between its voxels
+enum class SdfInterp : int { TRILINEAR, TRICUBIC };
+
+/**
+ * Signed distances stored on a regular grid, voxel (i, j, k) sits at
+ * origin + (i, j, k) * spacing. Points outside the volume take the value at the
+ * nearest point of the volume plus their distance to it
+ */
 class SDF : public LevelSet {
 public:
-	SDF(const Vec3i &res);
+	/// @param res voxels along each axis, at least 2
+	SDF(const Vec3i &res, Float spacing, const Vec3f &origin = Vec3f::Zero(),
+	    SdfInterp interp = SdfInterp::TRILINEAR);
 	~SDF() {}
 	virtual Float sdf(const Vec3f &xi) const;
+	/// Trilinear volumes gather the voxels of 8 points per instruction with AVX2
+	virtual void sdfBatch(const Float *x, const Float *y, const Float *z, int count, Float *out) const;
 	void setSdf(const Vec3i& xi, Float v);
+	void setInterp(SdfInterp interp) { interp_ = interp; }
+	Float getSdf(const Vec3i &xi) const { return value_[(xi.z() * res_.y() + xi.y()) * res_.x() + xi.x()]; }
+	const Vec3i &res() const { return res_; }
+	const Vec3f &origin() const { return origin_; }
+	Float spacing() const { return spacing_; }
 private:
+	/// Interpolate at a point in voxel coordinates inside the volume
+	Float trilinear(const Vec3f &g) const;
+	/// Catmull-Rom interpolation of the 4x4x4 nearest voxels
+	Float tricubic(const Vec3f &g) const;
+
 	Vec3i res_;
+	Vec3f origin_;
+	/// Position of the last voxel
+	Vec3f upper_;
+	Float spacing_;
+	Float invSpacing_;
+	SdfInterp interp_;
 	std::vector<Float> value_;
-};
\ No newline at end of file
+};
+
+/// Voxels along each axis of a NarrowBandSDF tile
+const static int SDF_TILE = 4;
+
+/**
+ * SDF volume that keeps its values only in tiles near the zero level set.
+ * Every other tile stores one value, the band width with the sign of its voxels.
+ * Samples trilinearly and extends outside the volume like SDF
+ */
+class NarrowBandSDF : public LevelSet {
+public:
+  /**
+   * @param volume dense volume to compress
+   * @param band tiles with a voxel at most band from the surface keep their values,
+   *             at least the voxel spacing so that every sign change stays in the band
+   */
+  NarrowBandSDF(const SDF &volume, Float band);
+  ~NarrowBandSDF() {}
+  virtual Float sdf(const Vec3f &xi) const;
+  virtual void sdfBatch(const Float *x, const Float *y, const Float *z, int count, Float *out) const;
+  virtual bool bounds(Vec3f &lo, Vec3f &hi) const;
+
+  /// Number of tiles that keep their values
+  int numBandTiles() const { return bandValue_.size() / TILE_VALUES; }
+
+private:
+  /// A tile holds the cells of SDF_TILE voxels along each axis, and so their far corners too
+  const static int TILE_VALUES = (SDF_TILE + 1) * (SDF_TILE + 1) * (SDF_TILE + 1);
+
+  Vec3i res_;
+  Vec3i tileDim_;
+  Vec3f origin_;
+  /// Position of the last voxel
+  Vec3f upper_;
+  Float invSpacing_;
+  /// Slot in bandValue_ of every tile, -1 outside the band
+  std::vector<int> tileSlot_;
+  /// Value of every tile outside the band
+  std::vector<Float> farValue_;
+  /// TILE_VALUES voxels of every band tile, x-major. Shared faces are stored twice
+  std::vector<Float> bandValue_;
+  /// The volume is the bounds, unbounded if its border is inside
+  bool bounded_ = false;
+};
+
+/// Union of level sets, the minimum of their sdf
+class Union : public LevelSet {
+public:
+  explicit Union(std::vector<uPtr<LevelSet>> children);
+  virtual Float sdf(const Vec3f &xi) const;
+  virtual void sdfBatch(const Float *x, const Float *y, const Float *z, int count, Float *out) const;
+  virtual bool bounds(Vec3f &lo, Vec3f &hi) const;
+  /// Velocity of the nearest child
+  virtual Vec3f velocity(const Vec3f &xi) const;
+  virtual bool moving() const;
+  virtual void advance(Float dt);
+private:
+  /// Bounds of the current children
+  void updateBounds();
+
+  std::vector<uPtr<LevelSet>> children_;
+  bool bounded_;
+  Vec3f lo_, hi_;
+};
+
+/// Intersection of level sets, the maximum of their sdf
+class Intersection : public LevelSet {
+public:
+  explicit Intersection(std::vector<uPtr<LevelSet>> children);
+  virtual Float sdf(const Vec3f &xi) const;
+  virtual void sdfBatch(const Float *x, const Float *y, const Float *z, int count, Float *out) const;
+  virtual bool bounds(Vec3f &lo, Vec3f &hi) const;
+  /// Velocity of the child with the largest sdf
+  virtual Vec3f velocity(const Vec3f &xi) const;
+  virtual bool moving() const;
+  virtual void advance(Float dt);
+private:
+  /// Bounds of the current children
+  void updateBounds();
+
+  std::vector<uPtr<LevelSet>> children_;
+  bool bounded_;
+  Vec3f lo_, hi_;
+};
+
+/// Level set a with level set b cut away
+class Difference : public LevelSet {
+public:
+  Difference(uPtr<LevelSet> a, uPtr<LevelSet> b);
+  virtual Float sdf(const Vec3f &xi) const;
+  /// b is skipped where it can't cut into a
+  virtual void sdfBatch(const Float *x, const Float *y, const Float *z, int count, Float *out) const;
+  virtual bool bounds(Vec3f &lo, Vec3f &hi) const { return a_->bounds(lo, hi); }
+  /// Velocity of the level set whose surface is nearer
+  virtual Vec3f velocity(const Vec3f &xi) const;
+  virtual bool moving() const { return a_->moving() || b_->moving(); }
+  virtual void advance(Float dt);
+private:
+  uPtr<LevelSet> a_, b_;
+};
+
+/**
+ * Union of level sets blended within k of each other by a quadratic smooth
+ * minimum folded over the children in order. Each fold lies at most k / 4 below
+ * the minimum, so n children dip at most (n - 1) * k / 4 below it
+ */
+class SmoothUnion : public LevelSet {
+public:
+  SmoothUnion(std::vector<uPtr<LevelSet>> children, Float k);
+  virtual Float sdf(const Vec3f &xi) const;
+  virtual void sdfBatch(const Float *x, const Float *y, const Float *z, int count, Float *out) const;
+  virtual bool bounds(Vec3f &lo, Vec3f &hi) const;
+  /// Velocity of the nearest child
+  virtual Vec3f velocity(const Vec3f &xi) const;
+  virtual bool moving() const;
+  virtual void advance(Float dt);
+private:
+  /// Bounds of the current children
+  void updateBounds();
+
+  std::vector<uPtr<LevelSet>> children_;
+  Float k_;
+  bool bounded_;
+  Vec3f lo_, hi_;
+};
+
+/**
+ * Level set moved by a rigid transform. The shape keeps its own frame and is
+ * never resampled, a world point x sits at rotation^T * (x - translation) in it.
+ * The pose advances along its velocities every step, a pose set by hand between
+ * steps needs Engine::generateLevelset
+ */
+class TransformedLevelSet : public LevelSet {
+public:
+  /// @param shape level set in its own frame, usually a cached SDF
+  explicit TransformedLevelSet(uPtr<LevelSet> shape);
+  virtual Float sdf(const Vec3f &xi) const;
+  virtual void sdfBatch(const Float *x, const Float *y, const Float *z, int count, Float *out) const;
+  /// Box around the transformed bounds of the shape
+  virtual bool bounds(Vec3f &lo, Vec3f &hi) const;
+  virtual Vec3f velocity(const Vec3f &xi) const;
+  virtual bool moving() const { return !linearVel_.isZero() || !angularVel_.isZero(); }
+  virtual void advance(Float dt);
+
+  /// @param rotation orthonormal, from the shape frame to the world
+  void setTransform(const Mat3f &rotation, const Vec3f &translation);
+
+  /**
+   * @param linear velocity of the shape frame origin
+   * @param angular angular velocity around the shape frame origin, in world axes
+   */
+  void setVelocity(const Vec3f &linear, const Vec3f &angular);
+
+private:
+  uPtr<LevelSet> shape_;
+  Mat3f rotation_ = Mat3f::Identity();
+  Vec3f translation_ = Vec3f::Zero();
+  Vec3f linearVel_ = Vec3f::Zero();
+  Vec3f angularVel_ = Vec3f::Zero();
+};
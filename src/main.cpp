@@ -1,4 +1,5 @@
 #include "engine.h"
+#include <cstdlib>
 #include <cstring>
 
 #if defined(WIN32) || defined(_WIN32) || defined(__WIN32) && !defined(__CYGWIN__)
@@ -23,11 +24,19 @@ int main(int argc, char *argv[]) {
   profiler.profStart(ProfType::INIT);
   params.setMaterial(pType);
   params.setOutput(true, true);
+  // Optional first argument: number of worker threads
+  if (argc > 1) {
+    params.numThreads = std::atoi(argv[1]);
+  }
   params.log();
   Engine engine;
   engine.particleList_.type_ = pType;
   engine.particleList_.initToSquare();
   engine.initBoundary(3);
+  // Optional second argument: OBJ or PLY obstacle mesh
+  if (argc > 2) {
+    engine.addMeshObstacle(argv[2]);
+  }
   engine.generateLevelset();
 
   profiler.profEnd(ProfType::INIT);
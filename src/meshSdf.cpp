@@ -0,0 +1,471 @@
+#include "meshSdf.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <sstream>
+#include <stdexcept>
+
+/// Add the fan of a polygon given by 0-based vertex indices
+static void addPolygon(const std::vector<int> &poly, TriMesh &mesh) {
+  for (int i = 2; i < (int)poly.size(); i++) {
+    mesh.triangles.emplace_back(poly[0], poly[i - 1], poly[i]);
+  }
+}
+
+static void loadObj(std::ifstream &in, TriMesh &mesh) {
+  std::string line, token;
+  std::vector<int> poly;
+  while (std::getline(in, line)) {
+    std::istringstream ss(line);
+    if (!(ss >> token)) {
+      continue;
+    }
+    if (token == "v") {
+      Vec3f v;
+      ss >> v[0] >> v[1] >> v[2];
+      mesh.vertices.push_back(v);
+    } else if (token == "f") {
+      poly.clear();
+      while (ss >> token) {
+        // v, v/vt, v//vn or v/vt/vn, negative indices count from the last vertex
+        int idx = std::stoi(token.substr(0, token.find('/')));
+        poly.push_back(idx < 0 ? mesh.vertices.size() + idx : idx - 1);
+      }
+      addPolygon(poly, mesh);
+    }
+  }
+}
+
+/// Size in bytes of a PLY scalar type
+static int plyTypeSize(const std::string &type) {
+  if (type == "char" || type == "uchar" || type == "int8" || type == "uint8") return 1;
+  if (type == "short" || type == "ushort" || type == "int16" || type == "uint16") return 2;
+  if (type == "int" || type == "uint" || type == "int32" || type == "uint32" ||
+      type == "float" || type == "float32") return 4;
+  if (type == "double" || type == "float64") return 8;
+  throw std::runtime_error("[loadMesh] unknown PLY type " + type);
+}
+
+/// Read one binary little endian PLY scalar as a double
+static double readPlyValue(std::ifstream &in, const std::string &type) {
+  unsigned char bytes[8] = {};
+  in.read(reinterpret_cast<char *>(bytes), plyTypeSize(type));
+  if (type == "float" || type == "float32") {
+    float v;
+    std::memcpy(&v, bytes, 4);
+    return v;
+  }
+  if (type == "double" || type == "float64") {
+    double v;
+    std::memcpy(&v, bytes, 8);
+    return v;
+  }
+  uint32_t u = bytes[0] | bytes[1] << 8 | bytes[2] << 16 | uint32_t(bytes[3]) << 24;
+  int size = plyTypeSize(type);
+  bool isSigned = type[0] != 'u';
+  if (size == 1) return isSigned ? double(int8_t(u)) : double(uint8_t(u));
+  if (size == 2) return isSigned ? double(int16_t(u)) : double(uint16_t(u));
+  return isSigned ? double(int32_t(u)) : double(u);
+}
+
+static void loadPly(std::ifstream &in, TriMesh &mesh) {
+  struct Property {
+    std::string name, type, countType;
+  };
+  struct Element {
+    std::string name;
+    int count;
+    std::vector<Property> props;
+  };
+  std::vector<Element> elements;
+  std::string line, token;
+  bool binary = false;
+  while (std::getline(in, line)) {
+    std::istringstream ss(line);
+    ss >> token;
+    if (token == "format") {
+      ss >> token;
+      if (token == "binary_big_endian") {
+        throw std::runtime_error("[loadMesh] big endian PLY is not supported");
+      }
+      binary = token == "binary_little_endian";
+    } else if (token == "element") {
+      Element e;
+      ss >> e.name >> e.count;
+      elements.push_back(e);
+    } else if (token == "property" && !elements.empty()) {
+      Property p;
+      ss >> p.type;
+      if (p.type == "list") {
+        ss >> p.countType >> p.type;
+      }
+      ss >> p.name;
+      elements.back().props.push_back(p);
+    } else if (token == "end_header") {
+      break;
+    }
+  }
+  std::vector<int> poly;
+  for (const Element &e : elements) {
+    for (int n = 0; n < e.count; n++) {
+      std::istringstream ss;
+      if (!binary) {
+        std::getline(in, line);
+        ss.str(line);
+      }
+      auto read = [&](const std::string &type) {
+        double v = 0;
+        if (binary) {
+          v = readPlyValue(in, type);
+        } else {
+          ss >> v;
+        }
+        return v;
+      };
+      Vec3f v = Vec3f::Zero();
+      poly.clear();
+      for (const Property &p : e.props) {
+        if (!p.countType.empty()) {
+          int count = read(p.countType);
+          for (int i = 0; i < count; i++) {
+            int idx = read(p.type);
+            if (e.name == "face") {
+              poly.push_back(idx);
+            }
+          }
+        } else {
+          double value = read(p.type);
+          if (e.name == "vertex" && (p.name == "x" || p.name == "y" || p.name == "z")) {
+            v[p.name[0] - 'x'] = value;
+          }
+        }
+      }
+      if (e.name == "vertex") {
+        mesh.vertices.push_back(v);
+      } else if (e.name == "face") {
+        addPolygon(poly, mesh);
+      }
+    }
+  }
+  if (!in) {
+    throw std::runtime_error("[loadMesh] truncated PLY file");
+  }
+}
+
+TriMesh loadMesh(const std::string &path) {
+  std::ifstream in(path, std::ios::binary);
+  if (!in) {
+    throw std::runtime_error("[loadMesh] cannot open file " + path);
+  }
+  TriMesh mesh;
+  std::string ext = path.substr(path.find_last_of('.') + 1);
+  std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+  if (ext == "obj") {
+    loadObj(in, mesh);
+  } else if (ext == "ply") {
+    loadPly(in, mesh);
+  } else {
+    throw std::runtime_error("[loadMesh] unknown mesh format " + path);
+  }
+  for (const Vec3i &t : mesh.triangles) {
+    if (t.minCoeff() < 0 || t.maxCoeff() >= (int)mesh.vertices.size()) {
+      throw std::runtime_error("[loadMesh] vertex index out of range in " + path);
+    }
+  }
+  return mesh;
+}
+
+namespace {
+
+/// Closest point of triangle abc to p
+Vec3f closestOnTriangle(const Vec3f &p, const Vec3f &a, const Vec3f &b, const Vec3f &c) {
+  Vec3f ab = b - a, ac = c - a, ap = p - a;
+  Float d1 = ab.dot(ap), d2 = ac.dot(ap);
+  if (d1 <= 0.f && d2 <= 0.f) {
+    return a;
+  }
+  Vec3f bp = p - b;
+  Float d3 = ab.dot(bp), d4 = ac.dot(bp);
+  if (d3 >= 0.f && d4 <= d3) {
+    return b;
+  }
+  Float vc = d1 * d4 - d3 * d2;
+  if (vc <= 0.f && d1 >= 0.f && d3 <= 0.f) {
+    return a + d1 / (d1 - d3) * ab;
+  }
+  Vec3f cp = p - c;
+  Float d5 = ab.dot(cp), d6 = ac.dot(cp);
+  if (d6 >= 0.f && d5 <= d6) {
+    return c;
+  }
+  Float vb = d5 * d2 - d1 * d6;
+  if (vb <= 0.f && d2 >= 0.f && d6 <= 0.f) {
+    return a + d2 / (d2 - d6) * ac;
+  }
+  Float va = d3 * d6 - d5 * d4;
+  if (va <= 0.f && d4 - d3 >= 0.f && d5 - d6 >= 0.f) {
+    return b + (d4 - d3) / ((d4 - d3) + (d5 - d6)) * (c - b);
+  }
+  Float denom = 1.f / (va + vb + vc);
+  return a + ab * (vb * denom) + ac * (vc * denom);
+}
+
+/// Bounding volume hierarchy over the triangles of a mesh, binary with small leaves
+class TriangleBvh {
+public:
+  explicit TriangleBvh(const TriMesh &mesh) : mesh_(mesh) {
+    int n = mesh.triangles.size();
+    order_.resize(n);
+    centroid_.resize(n);
+    for (int i = 0; i < n; i++) {
+      order_[i] = i;
+      const Vec3i &t = mesh.triangles[i];
+      centroid_[i] = (mesh.vertices[t[0]] + mesh.vertices[t[1]] + mesh.vertices[t[2]]) / 3.f;
+    }
+    nodes_.emplace_back();
+    if (n > 0) {
+      build(0, 0, n);
+    }
+  }
+
+  /// Squared distance from p to the mesh, maxDist2 if nothing is closer
+  Float nearestDist2(const Vec3f &p, Float maxDist2) const {
+    if (order_.empty()) {
+      return maxDist2;
+    }
+    Float best = maxDist2;
+    int stack[64], top = 0;
+    stack[top++] = 0;
+    while (top > 0) {
+      const Node &node = nodes_[stack[--top]];
+      if (boxDist2(node, p) >= best) {
+        continue;
+      }
+      if (node.count > 0) {
+        for (int i = node.first; i < node.first + node.count; i++) {
+          const Vec3i &t = mesh_.triangles[order_[i]];
+          Vec3f q = closestOnTriangle(p, mesh_.vertices[t[0]], mesh_.vertices[t[1]], mesh_.vertices[t[2]]);
+          best = std::min(best, (q - p).squaredNorm());
+        }
+        continue;
+      }
+      // Visit the nearer child first
+      int near = node.first, far = node.first + 1;
+      if (boxDist2(nodes_[near], p) > boxDist2(nodes_[far], p)) {
+        std::swap(near, far);
+      }
+      stack[top++] = far;
+      stack[top++] = near;
+    }
+    return best;
+  }
+
+  /// x of every crossing of the mesh with the line through (y, z) along x
+  void crossingsX(Float y, Float z, std::vector<Float> &xs) const {
+    if (order_.empty()) {
+      return;
+    }
+    int stack[64], top = 0;
+    stack[top++] = 0;
+    while (top > 0) {
+      const Node &node = nodes_[stack[--top]];
+      if (y < node.lo[1] || y > node.hi[1] || z < node.lo[2] || z > node.hi[2]) {
+        continue;
+      }
+      if (node.count == 0) {
+        stack[top++] = node.first;
+        stack[top++] = node.first + 1;
+        continue;
+      }
+      for (int i = node.first; i < node.first + node.count; i++) {
+        const Vec3i &t = mesh_.triangles[order_[i]];
+        const Vec3f &a = mesh_.vertices[t[0]], &b = mesh_.vertices[t[1]], &c = mesh_.vertices[t[2]];
+        // Barycentric coordinates in the yz plane, in double to keep the signs right
+        double wa = edge(b, c, y, z), wb = edge(c, a, y, z), wc = edge(a, b, y, z);
+        if ((wa > 0 && wb > 0 && wc > 0) || (wa < 0 && wb < 0 && wc < 0)) {
+          xs.push_back((wa * a[0] + wb * b[0] + wc * c[0]) / (wa + wb + wc));
+        }
+      }
+    }
+  }
+
+private:
+  struct Node {
+    Vec3f lo, hi;
+    /// Leaves hold count triangles from order_[first], inner nodes have count 0 and
+    /// their children at first and first + 1
+    int first = 0, count = 0;
+  };
+
+  static Float boxDist2(const Node &node, const Vec3f &p) {
+    return (node.lo - p).cwiseMax(p - node.hi).cwiseMax(0.f).squaredNorm();
+  }
+
+  static double edge(const Vec3f &u, const Vec3f &v, Float y, Float z) {
+    return (double(v[1]) - u[1]) * (double(z) - u[2]) - (double(v[2]) - u[2]) * (double(y) - u[1]);
+  }
+
+  void build(int nodeIdx, int begin, int end) {
+    Vec3f lo = Vec3f::Constant(std::numeric_limits<Float>::max()), hi = -lo;
+    Vec3f cLo = lo, cHi = hi;
+    for (int i = begin; i < end; i++) {
+      const Vec3i &t = mesh_.triangles[order_[i]];
+      for (int v = 0; v < 3; v++) {
+        lo = lo.cwiseMin(mesh_.vertices[t[v]]);
+        hi = hi.cwiseMax(mesh_.vertices[t[v]]);
+      }
+      cLo = cLo.cwiseMin(centroid_[order_[i]]);
+      cHi = cHi.cwiseMax(centroid_[order_[i]]);
+    }
+    nodes_[nodeIdx].lo = lo;
+    nodes_[nodeIdx].hi = hi;
+    if (end - begin <= LEAF_SIZE) {
+      nodes_[nodeIdx].first = begin;
+      nodes_[nodeIdx].count = end - begin;
+      return;
+    }
+    // Median split along the longest axis of the centroids
+    int axis;
+    (cHi - cLo).maxCoeff(&axis);
+    int mid = (begin + end) / 2;
+    std::nth_element(order_.begin() + begin, order_.begin() + mid, order_.begin() + end,
+                     [&](int a, int b) { return centroid_[a][axis] < centroid_[b][axis]; });
+    int children = nodes_.size();
+    nodes_.resize(children + 2);
+    nodes_[nodeIdx].first = children;
+    nodes_[nodeIdx].count = 0;
+    build(children, begin, mid);
+    build(children + 1, mid, end);
+  }
+
+  const static int LEAF_SIZE = 4;
+  const TriMesh &mesh_;
+  /// Triangles in leaf order
+  std::vector<int> order_;
+  std::vector<Vec3f> centroid_;
+  std::vector<Node> nodes_;
+};
+
+/// Run func(begin, end) over [0, count) on the pool, or inline without one
+template<typename F>
+void forRange(ThreadPool *pool, int count, int chunkSize, F &&func) {
+  if (pool) {
+    pool->parallelFor(count, chunkSize, func);
+  } else {
+    func(0, count);
+  }
+}
+
+/**
+ * Fill the unfixed voxels with distances that solve |grad d| = 1 from the fixed ones.
+ * Every sweep direction visits the planes i + j + k = level in order, the voxels of
+ * one plane only depend on the previous plane and are updated in parallel
+ */
+void fastSweep(std::vector<Float> &dist, const std::vector<char> &fixed, const Vec3i &res, Float h,
+               ThreadPool *pool) {
+  const int stride[3] = {1, res[0], res[0] * res[1]};
+  const Float inf = std::numeric_limits<Float>::max();
+  auto update = [&](const Vec3i &idx) {
+    int offset = idx[0] + idx[1] * stride[1] + idx[2] * stride[2];
+    if (fixed[offset]) {
+      return;
+    }
+    // Smallest neighbour along each axis, sorted
+    Float n[3];
+    for (int c = 0; c < 3; c++) {
+      n[c] = inf;
+      if (idx[c] > 0) n[c] = dist[offset - stride[c]];
+      if (idx[c] < res[c] - 1) n[c] = std::min(n[c], dist[offset + stride[c]]);
+    }
+    std::sort(n, n + 3);
+    if (n[0] == inf) {
+      return;
+    }
+    Float d = n[0] + h;
+    if (d > n[1]) {
+      d = 0.5f * (n[0] + n[1] + std::sqrt(2.f * h * h - (n[0] - n[1]) * (n[0] - n[1])));
+      if (d > n[2]) {
+        Float sum = n[0] + n[1] + n[2];
+        Float sq = n[0] * n[0] + n[1] * n[1] + n[2] * n[2];
+        d = (sum + std::sqrt(std::max(sum * sum - 3.f * (sq - h * h), 0.f))) / 3.f;
+      }
+    }
+    dist[offset] = std::min(dist[offset], d);
+  };
+  const int numLevels = res.sum() - 2;
+  for (int dir = 0; dir < 8; dir++) {
+    for (int level = 0; level < numLevels; level++) {
+      int zLo = std::max(0, level - (res[0] - 1) - (res[1] - 1)), zHi = std::min(res[2] - 1, level);
+      forRange(pool, zHi - zLo + 1, 4, [&](int begin, int end) {
+        Vec3i step, idx;
+        for (step[2] = zLo + begin; step[2] < zLo + end; step[2]++) {
+          int yLo = std::max(0, level - step[2] - (res[0] - 1)), yHi = std::min(res[1] - 1, level - step[2]);
+          for (step[1] = yLo; step[1] <= yHi; step[1]++) {
+            step[0] = level - step[2] - step[1];
+            for (int c = 0; c < 3; c++) {
+              idx[c] = (dir >> c & 1) ? res[c] - 1 - step[c] : step[c];
+            }
+            update(idx);
+          }
+        }
+      });
+    }
+  }
+}
+
+}
+
+uPtr<SDF> meshToSdf(const TriMesh &mesh, const Vec3i &res, Float spacing, const Vec3f &origin,
+                    Float band, ThreadPool *pool) {
+  CHECK(band >= spacing) << "Exact band thinner than a voxel";
+  TriangleBvh bvh(mesh);
+  const Float inf = std::numeric_limits<Float>::max();
+  std::vector<Float> dist(res.prod(), inf);
+  std::vector<char> fixed(res.prod()), inside(res.prod());
+  // Rays slightly off the voxel rows so they don't run through mesh edges
+  const Float jitterY = 1e-3f * spacing * 0.7071f, jitterZ = 1e-3f * spacing * 0.3183f;
+  forRange(pool, res[1] * res[2], 8, [&](int begin, int end) {
+    std::vector<Float> xs;
+    for (int row = begin; row < end; row++) {
+      int j = row % res[1], k = row / res[1];
+      Float y = origin[1] + j * spacing, z = origin[2] + k * spacing;
+      int offset = row * res[0];
+      for (int i = 0; i < res[0]; i++) {
+        Vec3f p(origin[0] + i * spacing, y, z);
+        Float d2 = bvh.nearestDist2(p, band * band);
+        if (d2 < band * band) {
+          dist[offset + i] = std::sqrt(d2);
+          fixed[offset + i] = true;
+        }
+      }
+      // Inside where an odd number of crossings lies before the voxel
+      xs.clear();
+      bvh.crossingsX(y + jitterY, z + jitterZ, xs);
+      std::sort(xs.begin(), xs.end());
+      int crossed = 0;
+      for (int i = 0; i < res[0]; i++) {
+        Float x = origin[0] + i * spacing;
+        while (crossed < (int)xs.size() && xs[crossed] < x) {
+          crossed++;
+        }
+        inside[offset + i] = crossed & 1;
+      }
+    }
+  });
+  fastSweep(dist, fixed, res, spacing, pool);
+  uPtr<SDF> sdf = mkU<SDF>(res, spacing, origin);
+  Vec3i idx;
+  for (idx[2] = 0; idx[2] < res[2]; idx[2]++) {
+    for (idx[1] = 0; idx[1] < res[1]; idx[1]++) {
+      for (idx[0] = 0; idx[0] < res[0]; idx[0]++) {
+        int offset = idx[0] + (idx[1] + idx[2] * res[1]) * res[0];
+        sdf->setSdf(idx, inside[offset] ? -dist[offset] : dist[offset]);
+      }
+    }
+  }
+  return sdf;
+}
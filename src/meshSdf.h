@@ -0,0 +1,33 @@
+#pragma once
+
+#include <string>
+
+#include "global.h"
+#include "levelSet.h"
+#include "threadPool.h"
+
+/// Triangle mesh, vertex positions and the vertex indices of every triangle
+struct TriMesh {
+  std::vector<Vec3f> vertices;
+  std::vector<Vec3i> triangles;
+};
+
+/**
+ * Read a triangle mesh from an OBJ or PLY file, picked by the extension.
+ * PLY files may be ASCII or binary little endian. Polygons are split into
+ * triangle fans, everything but positions and faces is skipped
+ * @param path file to read, throws if it can't be read
+ */
+TriMesh loadMesh(const std::string &path);
+
+/**
+ * Signed distance volume of a closed triangle mesh, negative inside.
+ * Voxels within band of the surface get exact distances from a triangle BVH,
+ * the others are filled by fast sweeping. The sign is the parity of the mesh
+ * crossings along x, so the mesh has to be watertight
+ * @param res voxels along each axis, voxel (i, j, k) sits at origin + (i, j, k) * spacing
+ * @param band width of the exact band, at least the voxel spacing
+ * @param pool runs the rows and sweeps in parallel, may be null
+ */
+uPtr<SDF> meshToSdf(const TriMesh &mesh, const Vec3i &res, Float spacing, const Vec3f &origin,
+                    Float band, ThreadPool *pool);
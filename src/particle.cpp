@@ -1,8 +1,14 @@
 #include "particle.h"
 #include "plasticity.h"
 
-ParticleList::~ParticleList() {
-  delete particles_;
+/// Gather values into the given order
+template<typename T>
+static void applyOrder(const std::vector<int> &order, AlignedVector<T> *values) {
+  AlignedVector<T> sorted(values->size());
+  for (size_t i = 0; i < order.size(); i++) {
+    sorted[i] = (*values)[order[i]];
+  }
+  values->swap(sorted);
 }
 
 void ParticleList::initToSquare() {
@@ -19,7 +25,7 @@ void ParticleList::initToSquare() {
                 zc = z + static_cast<Float>(rand()) / RAND_MAX;
           Vec3f pos; pos << xc, yc, zc;
           pos *= params.spacing;
-          (*particles_).push_back(Particle(pos, params.pMass));
+          push_back(Particle(pos, params.pMass));
         }
       }
     }
@@ -28,14 +34,109 @@ void ParticleList::initToSquare() {
 
 Vec3f ParticleList::calcMomentum() const {
   Vec3f momentum = Vec3f::Constant(0.f);
-  for (const Particle &p : (*particles_)) {
-    momentum += p.mass * p.vel;
+  for (size_t i = 0; i < size(); i++) {
+    momentum += mass_[i] * vel_[i];
   }
   return momentum;
 }
 
 void ParticleList::advection() {
-  for (Particle &p : *particles_) {
-    p.pos += p.vel * params.timeStep;
+  for (size_t i = 0; i < size(); i++) {
+    pos_[i] += vel_[i] * params.timeStep;
   }
-}
\ No newline at end of file
+}
+
+void ParticleList::clear() {
+  pos_.clear();
+  mass_.clear();
+  vel_.clear();
+  Bp_.clear();
+  Fe_.clear();
+  Fp_.clear();
+  alpha_.clear();
+  q_.clear();
+  id_.clear();
+  indexOfId_.clear();
+}
+
+void ParticleList::reserve(size_t count) {
+  pos_.reserve(count);
+  mass_.reserve(count);
+  vel_.reserve(count);
+  Bp_.reserve(count);
+  Fe_.reserve(count);
+  Fp_.reserve(count);
+  alpha_.reserve(count);
+  q_.reserve(count);
+  id_.reserve(count);
+  indexOfId_.reserve(count);
+}
+
+void ParticleList::push_back(const Particle &p) {
+  pos_.push_back(p.pos);
+  mass_.push_back(p.mass);
+  vel_.push_back(p.vel);
+  Bp_.push_back(p.Bp);
+  Fe_.push_back(p.Fe);
+  Fp_.push_back(p.Fp);
+  alpha_.push_back(p.alpha);
+  q_.push_back(p.q);
+  id_.push_back(indexOfId_.size());
+  indexOfId_.push_back(indexOfId_.size());
+}
+
+Particle ParticleList::get(int i) const {
+  // The deprecated volume is derived from the mass like the Particle constructor does
+  Particle p(pos_[i], mass_[i]);
+  p.vel = vel_[i];
+  p.Bp = Bp_[i];
+  p.Fe = Fe_[i];
+  p.Fp = Fp_[i];
+  p.alpha = alpha_[i];
+  p.q = q_[i];
+  return p;
+}
+
+void ParticleList::set(int i, const Particle &p) {
+  pos_[i] = p.pos;
+  mass_[i] = p.mass;
+  vel_[i] = p.vel;
+  Bp_[i] = p.Bp;
+  Fe_[i] = p.Fe;
+  Fp_[i] = p.Fp;
+  alpha_[i] = p.alpha;
+  q_[i] = p.q;
+}
+
+void ParticleList::fromVector(const std::vector<Particle> &particles) {
+  clear();
+  reserve(particles.size());
+  for (const Particle &p : particles) {
+    push_back(p);
+  }
+}
+
+std::vector<Particle> ParticleList::toVector() const {
+  std::vector<Particle> particles;
+  particles.reserve(size());
+  for (size_t i = 0; i < size(); i++) {
+    particles.push_back(get(i));
+  }
+  return particles;
+}
+
+void ParticleList::permute(const std::vector<int> &order) {
+  CHECK(order.size() == size()) << "Permutation of " << order.size() << " particles for " << size();
+  applyOrder(order, &pos_);
+  applyOrder(order, &mass_);
+  applyOrder(order, &vel_);
+  applyOrder(order, &Bp_);
+  applyOrder(order, &Fe_);
+  applyOrder(order, &Fp_);
+  applyOrder(order, &alpha_);
+  applyOrder(order, &q_);
+  applyOrder(order, &id_);
+  for (size_t i = 0; i < size(); i++) {
+    indexOfId_[id_[i]] = i;
+  }
+}
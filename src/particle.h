@@ -1,6 +1,8 @@
 #pragma once
  
 #include "global.h"
+#include "alignedAllocator.h"
+#include <type_traits>
 #include <vector>
 
 
@@ -28,19 +30,107 @@ struct Particle {
   Float q = 0.f;
 };
 
+/**
+ * Proxy to the attributes of one particle in a ParticleList, reads and
+ * writes go straight to the attribute arrays.
+ * Use ConstParticleRef for read only access.
+ */
+template<bool IsConst>
+struct BasicParticleRef {
+  template<typename T>
+  using Ref = typename std::conditional<IsConst, const T &, T &>::type;
+
+  Ref<Vec3f> pos;
+  Ref<Float> mass;
+  Ref<Vec3f> vel;
+  /// The APIC Bp matrix
+  Ref<Mat3f> Bp;
+  /// Elastic part of F
+  Ref<Mat3f> Fe;
+  /// Plastic part of F
+  Ref<Mat3f> Fp;
+  /// Yield surface size, used in plasticity hardening
+  Ref<Float> alpha;
+  /// Hardening state, used in plasticity hardening
+  Ref<Float> q;
+};
+
+typedef BasicParticleRef<false> ParticleRef;
+typedef BasicParticleRef<true> ConstParticleRef;
+
+/**
+ * Particles stored as structure of arrays, one cache line aligned array per
+ * attribute, so a stage only streams the attributes it touches.
+ * Index with operator[] for a ParticleRef, or use the arrays directly in hot loops.
+ */
 class ParticleList {
 public:
-	ParticleList() : particles_(new std::vector<Particle>()) {}
-  ~ParticleList();
+  ParticleList() {}
+
   void initToSquare();
 
   Vec3f calcMomentum() const;
 
   /// Update particle velocity
   void advection();
-  
-  /// List of unique pointer to particles 
-  std::vector<Particle> *particles_;
+
+  size_t size() const { return pos_.size(); }
+
+  bool empty() const { return pos_.empty(); }
+
+  void clear();
+
+  void reserve(size_t count);
+
+  /// Append a particle
+  void push_back(const Particle &p);
+
+  ParticleRef operator[](int i) {
+    return {pos_[i], mass_[i], vel_[i], Bp_[i], Fe_[i], Fp_[i], alpha_[i], q_[i]};
+  }
+
+  ConstParticleRef operator[](int i) const {
+    return {pos_[i], mass_[i], vel_[i], Bp_[i], Fe_[i], Fp_[i], alpha_[i], q_[i]};
+  }
+
+  /// Copy of particle i
+  Particle get(int i) const;
+
+  /// Current index of the particle with a stable id
+  int indexOf(int id) const { return indexOfId_[id]; }
+
+  /// Copy of the particle with a stable id, ids follow insertion order
+  Particle getById(int id) const { return get(indexOfId_[id]); }
+
+  /// Overwrite particle i
+  void set(int i, const Particle &p);
+
+  /// Replace all particles, e.g. with particles read by the Houdini plugin
+  void fromVector(const std::vector<Particle> &particles);
+
+  /// Copy of all particles in order
+  std::vector<Particle> toVector() const;
+
+  /**
+   * Reorder all attribute arrays, stable ids move with their particles
+   * @param order order[i] is the current index of the particle that moves to i
+   */
+  void permute(const std::vector<int> &order);
+
+  /// Attribute arrays, all of size()
+  AlignedVector<Vec3f> pos_;
+  AlignedVector<Float> mass_;
+  AlignedVector<Vec3f> vel_;
+  AlignedVector<Mat3f> Bp_;
+  AlignedVector<Mat3f> Fe_;
+  AlignedVector<Mat3f> Fp_;
+  AlignedVector<Float> alpha_;
+  AlignedVector<Float> q_;
+  /// Stable id of each particle, its insertion index
+  AlignedVector<int> id_;
   ParticleType type_;
-};
 
+private:
+  /// Inverse of id_
+  std::vector<int> indexOfId_;
+};
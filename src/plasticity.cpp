@@ -32,35 +32,35 @@ void project(const Mat3f &sigma, Float alpha, Mat3f *T, Float *dq) {
   *dq = dGamma;
 }
 
-void plasticityHardening(Particle *p) {
-  SVDResult res = SVDDecompose(p->Fe);
+void plasticityHardening(const ParticleRef &p) {
+  SVDResult res = SVDDecompose(p.Fe);
   Mat3f T;
   Float dq;
-  project(res.Sigma, p->alpha, &T, &dq);
-  p->Fe = res.U * T * res.V.transpose();
-  p->Fp = res.V * T.inverse() * res.Sigma * res.V.transpose() * p->Fp;
-  p->q += dq;
+  project(res.Sigma, p.alpha, &T, &dq);
+  p.Fe = res.U * T * res.V.transpose();
+  p.Fp = res.V * T.inverse() * res.Sigma * res.V.transpose() * p.Fp;
+  p.q += dq;
   // internal friction angle
-  Float phiF = h0 + (h1 * p->q - h3) * std::exp(-h2 * p->q);
+  Float phiF = h0 + (h1 * p.q - h3) * std::exp(-h2 * p.q);
   Float sinF = std::sin(phiF * M_PI / 180.f);
-  p->alpha = std::sqrt(2.f / 3.f) * 2 * sinF / (3 - sinF);
+  p.alpha = std::sqrt(2.f / 3.f) * 2 * sinF / (3 - sinF);
 }
 
-void snowHardening(Particle *p) {
+void snowHardening(const ParticleRef &p) {
   // Notice here the Fe matrix has been updated
   // F_(n+1)
-  Mat3f F = p->Fe * p->Fp;
-  SVDResult res = SVDDecompose(p->Fe);
+  Mat3f F = p.Fe * p.Fp;
+  SVDResult res = SVDDecompose(p.Fe);
   for (int i = 0; i < 3; i++) {
     Float s = res.Sigma(i, i);
     // Clamp the value of singular values
     res.Sigma(i, i) = std::min(std::max(s, 1.f - params.thetaC), 1.f + params.thetaS);
   }
-  p->Fe = res.U * res.Sigma * res.V.transpose();
+  p.Fe = res.U * res.Sigma * res.V.transpose();
   // Get the inverse of the Sigma matrix
   Mat3f invSigma = res.Sigma;
   for (int i = 0; i < 3; i++) {
     invSigma(i, i) = 1.f / invSigma(i, i);
   }
-  p->Fp = res.V * invSigma * res.U.transpose() * F;
+  p.Fp = res.V * invSigma * res.U.transpose() * F;
 }
\ No newline at end of file
@@ -3,7 +3,7 @@
 #include "particle.h"
 
 /// Perform plasticity hardening on a single particle
-void plasticityHardening(Particle *p);
+void plasticityHardening(const ParticleRef &p);
 
 /// Simple hardening for snow
-void snowHardening(Particle *p);
+void snowHardening(const ParticleRef &p);
@@ -12,6 +12,8 @@ enum class ProfType {
   CALC_GRID_FORCE,
   GRID_VEL_UPDATE,
   UPDATE_DEFORM_GRAD,
+  STENCIL_CACHE,
+  REORDER,
   PLASTICITY_HARDENING,
   VISUALIZATION,
   OUTPUT_FILE,
@@ -21,7 +23,7 @@ enum class ProfType {
 class Profiler {
 public:
   using TimePoint = std::chrono::time_point<std::chrono::high_resolution_clock>;
-  using Duration = std::chrono::milliseconds;
+  using Duration = std::chrono::microseconds;
 
   std::unordered_map<ProfType, std::string> profName = {
     { ProfType::INIT, "Initialize" },
@@ -32,6 +34,8 @@ public:
     { ProfType::CALC_GRID_FORCE, "Calc_grid_force" },
     { ProfType::GRID_VEL_UPDATE, "Grid_velocity_update" },
     { ProfType::UPDATE_DEFORM_GRAD, "Update_deform_grad" },
+    { ProfType::STENCIL_CACHE, "Stencil_cache" },
+    { ProfType::REORDER, "Reorder" },
     { ProfType::PLASTICITY_HARDENING, "Plasticity_hardening" }
   };
 
@@ -39,6 +43,7 @@ public:
     for (auto &p : profName) {
       totalTime_[p.first] = Duration::zero();
       loopTime_[p.first] = Duration::zero();
+      totalCount_[p.first] = 0;
     }
   }
 
@@ -54,6 +59,13 @@ public:
 #endif
   }
 
+  /// Count items (e.g. particles) processed by a stage, reported as throughput
+  void profCount(ProfType type, long long count) {
+#ifdef PROFILE
+    totalCount_[type] += count;
+#endif
+  }
+
   /// Report the time distribution for this loop
   void reportLoop(int idx) {
 #ifdef PROFILE
@@ -66,7 +78,7 @@ public:
       if (p.second.count() == 0) {
         continue;
       }
-      DLOG(INFO) << profName[p.first] << " " << p.second.count() << "ms ";
+      DLOG(INFO) << profName[p.first] << " " << p.second.count() / 1000.0 << "ms ";
       DLOG(INFO) << p.second.count() / totalTime * 100.0 << "%";
       totalTime_[p.first] += p.second;
       p.second = Duration::zero();
@@ -83,13 +95,17 @@ public:
     for (auto &p : totalTime_) {
       totalTime += p.second.count();
     }
-    LOG(INFO) << "Total time is: " << totalTime << "ms";
+    LOG(INFO) << "Total time is: " << totalTime / 1000.0 << "ms";
     for (auto &p : totalTime_) {
       if (p.second.count() == 0) {
         continue;
       }
-      LOG(INFO) << profName[p.first] << " " << p.second.count() << "ms";
+      LOG(INFO) << profName[p.first] << " " << p.second.count() / 1000.0 << "ms";
       LOG(INFO) << p.second.count() / totalTime * 100.0 << "%";
+      if (totalCount_[p.first] > 0) {
+        LOG(INFO) << totalCount_[p.first] / (p.second.count() * 1e-6) << " items/s";
+        totalCount_[p.first] = 0;
+      }
       p.second = Duration::zero();
     }
     google::FlushLogFiles(google::GLOG_INFO);
@@ -98,5 +114,6 @@ public:
   
 private:
   std::unordered_map<ProfType, Duration> totalTime_, loopTime_;
+  std::unordered_map<ProfType, long long> totalCount_;
   std::unordered_map<ProfType, TimePoint> loopStart_;
 };
\ No newline at end of file
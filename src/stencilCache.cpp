@@ -0,0 +1,48 @@
+#include "stencilCache.h"
+
+#include <cstring>
+
+#include "weightBatch.h"
+
+/// Particles per quadWeightBatch call when filling the cache
+const static int STENCIL_BATCH = 64;
+
+template<>
+void StencilCache<QuadraticKernel>::fillRange(const AlignedVector<Vec3f> &pos,
+                                              Float spacing, int begin, int end) {
+  Float posInGrid[3][STENCIL_BATCH];
+  int base[3][STENCIL_BATCH];
+  Float weight[3][3][STENCIL_BATCH], weightDeriv[3][3][STENCIL_BATCH];
+  for (int batchBegin = begin; batchBegin < end; batchBegin += STENCIL_BATCH) {
+    int count = std::min(STENCIL_BATCH, end - batchBegin);
+    // Gather the positions into one lane per axis
+    for (int p = 0; p < count; p++) {
+      Vec3f posIdx = pos[batchBegin + p] / spacing;
+      for (int i = 0; i < 3; i++) {
+        posInGrid[i][p] = posIdx[i];
+      }
+    }
+    for (int i = 0; i < 3; i++) {
+      WeightBatch out = {base[i],
+                         {weight[i][0], weight[i][1], weight[i][2]},
+                         {weightDeriv[i][0], weightDeriv[i][1], weightDeriv[i][2]}};
+      quadWeightBatch(posInGrid[i], count, out);
+    }
+    for (int p = 0; p < count; p++) {
+      Stencil<QuadraticKernel> &stencil = stencils_[batchBegin + p];
+      for (int i = 0; i < 3; i++) {
+        stencil.base[i] = base[i][p];
+        for (int j = 0; j < 3; j++) {
+          stencil.weight(i, j) = weight[i][j][p];
+          stencil.weightDeriv(i, j) = weightDeriv[i][j][p];
+        }
+      }
+#ifdef MPM_DEBUG
+      Stencil<QuadraticKernel> expected;
+      computeStencil(pos[batchBegin + p] / spacing, &expected);
+      CHECK(std::memcmp(&expected, &stencil, sizeof(stencil)) == 0)
+          << "Batched stencil of particle " << batchBegin + p << " differs from scalar";
+#endif
+    }
+  }
+}
@@ -0,0 +1,115 @@
+#pragma once
+
+#include <algorithm>
+#include <vector>
+
+#include "global.h"
+#include "interpKernel.h"
+#include "alignedAllocator.h"
+#include "threadPool.h"
+
+/// Kernel weights of a particle over its nearby width^3 grid nodes
+template<class Kernel>
+struct Stencil {
+  typedef Eigen::Matrix<Float, 3, Kernel::width, Eigen::RowMajor | Eigen::DontAlign> Weights;
+  /// Grid index of the lowest stencil node
+  Vec3i base;
+  /// weight(i, j) is the weight of node base + j along axis i
+  Weights weight;
+  /// Derivative of weight, same layout
+  Weights weightDeriv;
+};
+
+/**
+ * Compute the stencil at a position
+ * @param posInGrid position in grid coordinate
+ * @param stencil output
+ */
+template<class Kernel>
+void computeStencil(const Vec3f &posInGrid, Stencil<Kernel> *stencil) {
+  for (int i = 0; i < 3; i++) {
+    stencil->base[i] =
+        Kernel::eval(posInGrid[i], &stencil->weight(i, 0), &stencil->weightDeriv(i, 0));
+  }
+}
+
+/// Kernel independent part of StencilCache
+class StencilCacheBase {
+public:
+  /**
+   * @param kernel kernel of the cached stencils
+   * @param budgetBytes maximum memory used by the stencils
+   */
+  StencilCacheBase(InterpKernel kernel, size_t budgetBytes)
+      : kernel_(kernel), budgetBytes_(budgetBytes) {}
+  virtual ~StencilCacheBase() {}
+
+  /// Kernel of the cached stencils
+  InterpKernel kernel() const { return kernel_; }
+
+  /// Mark the cache stale, call whenever particles move
+  void invalidate() { valid_ = false; }
+
+  bool valid() const { return valid_; }
+
+  void setBudget(size_t budgetBytes) { budgetBytes_ = budgetBytes; }
+
+protected:
+  InterpKernel kernel_;
+  size_t budgetBytes_;
+  bool valid_ = false;
+};
+
+/**
+ * Stencils of all particles, filled once per step and shared by P2G, the grid
+ * force pass and G2P until the particles are advected.
+ * When the particle count needs more memory than the budget the cache stays
+ * invalid and callers recompute the stencils instead.
+ */
+template<class Kernel>
+class StencilCache : public StencilCacheBase {
+public:
+  explicit StencilCache(size_t budgetBytes) : StencilCacheBase(Kernel::type, budgetBytes) {}
+
+  /**
+   * Compute and store the stencil of every particle
+   * @param pos particle positions
+   * @return false if the particles do not fit in the budget, the cache is invalid then
+   */
+  bool fill(const AlignedVector<Vec3f> &pos, Float spacing, ThreadPool *pool) {
+    if (pos.size() * sizeof(Stencil<Kernel>) > budgetBytes_) {
+      if (!stencils_.empty()) {
+        // Don't hold on to memory from a smaller particle count
+        std::vector<Stencil<Kernel>>().swap(stencils_);
+      }
+      valid_ = false;
+      return false;
+    }
+    profiler.profStart(ProfType::STENCIL_CACHE);
+    stencils_.resize(pos.size());
+    pool->parallelFor(pos.size(), 4096, [&](int begin, int end) {
+      fillRange(pos, spacing, begin, end);
+    });
+    profiler.profCount(ProfType::STENCIL_CACHE, pos.size());
+    profiler.profEnd(ProfType::STENCIL_CACHE);
+    valid_ = true;
+    return true;
+  }
+
+  const Stencil<Kernel> &operator[](int i) const { return stencils_[i]; }
+
+private:
+  /// Fill the stencils of particles [begin, end)
+  void fillRange(const AlignedVector<Vec3f> &pos, Float spacing, int begin, int end) {
+    for (int i = begin; i < end; i++) {
+      computeStencil(pos[i] / spacing, &stencils_[i]);
+    }
+  }
+
+  std::vector<Stencil<Kernel>> stencils_;
+};
+
+/// The quadratic kernel fills its stencils with the SIMD quadWeightBatch
+template<>
+void StencilCache<QuadraticKernel>::fillRange(const AlignedVector<Vec3f> &pos,
+                                              Float spacing, int begin, int end);
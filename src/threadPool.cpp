@@ -0,0 +1,64 @@
+#include "threadPool.h"
+
+ThreadPool::ThreadPool(int numThreads) : nextChunk_(0) {
+  if (numThreads <= 0) {
+    numThreads = std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+  }
+  for (int i = 1; i < numThreads; i++) {
+    workers_.emplace_back(&ThreadPool::workerLoop, this);
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  wakeCond_.notify_all();
+  for (std::thread &t : workers_) {
+    t.join();
+  }
+}
+
+void ThreadPool::run(const std::function<void(int, int)> &func, int count, int chunkSize) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    func_ = &func;
+    count_ = count;
+    chunkSize_ = chunkSize;
+    nextChunk_ = 0;
+    busyWorkers_ = workers_.size();
+    generation_++;
+  }
+  wakeCond_.notify_all();
+  runChunks();
+  std::unique_lock<std::mutex> lock(mutex_);
+  doneCond_.wait(lock, [this] { return busyWorkers_ == 0; });
+  func_ = nullptr;
+}
+
+void ThreadPool::runChunks() {
+  for (int begin = nextChunk_.fetch_add(chunkSize_); begin < count_;
+       begin = nextChunk_.fetch_add(chunkSize_)) {
+    (*func_)(begin, std::min(begin + chunkSize_, count_));
+  }
+}
+
+void ThreadPool::workerLoop() {
+  int seenGeneration = 0;
+  while (true) {
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      wakeCond_.wait(lock, [&] { return stop_ || generation_ != seenGeneration; });
+      if (stop_) {
+        return;
+      }
+      seenGeneration = generation_;
+    }
+    runChunks();
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (--busyWorkers_ == 0) {
+      doneCond_.notify_one();
+    }
+  }
+}
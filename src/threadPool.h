@@ -0,0 +1,66 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "global.h"
+
+/**
+ * Fixed set of worker threads that stay alive between parallel loops.
+ * The calling thread takes part in every loop, so a pool of one thread
+ * runs everything inline. Loops must not be nested or issued concurrently.
+ */
+class ThreadPool {
+public:
+  /// @param numThreads total threads including the caller, 0 uses all hardware threads
+  explicit ThreadPool(int numThreads);
+  ~ThreadPool();
+
+  int numThreads() const { return workers_.size() + 1; }
+
+  /**
+   * Split [0, count) into chunks and process them on all threads.
+   * Chunks are handed out dynamically, so expensive chunks do not stall the loop.
+   * @param count number of items
+   * @param chunkSize number of items per chunk
+   * @param func called as func(begin, end) for every chunk
+   */
+  template<typename F>
+  void parallelFor(int count, int chunkSize, F&& func) {
+    if (count <= 0) {
+      return;
+    }
+    if (workers_.empty() || count <= chunkSize) {
+      func(0, count);
+      return;
+    }
+    run(std::function<void(int, int)>(std::forward<F>(func)), count, chunkSize);
+  }
+
+private:
+  /// Publish a loop to the workers, take part in it and wait for it to finish
+  void run(const std::function<void(int, int)> &func, int count, int chunkSize);
+
+  /// Claim and process chunks of the current loop until there are none left
+  void runChunks();
+
+  void workerLoop();
+
+  std::vector<std::thread> workers_;
+  std::mutex mutex_;
+  std::condition_variable wakeCond_, doneCond_;
+  /// Current loop
+  const std::function<void(int, int)> *func_ = nullptr;
+  int count_ = 0, chunkSize_ = 1;
+  std::atomic<int> nextChunk_;
+  /// Bumped for every loop so sleeping workers know there is new work
+  int generation_ = 0;
+  /// Workers still busy with the current loop
+  int busyWorkers_ = 0;
+  bool stop_ = false;
+};
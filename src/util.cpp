@@ -8,6 +8,21 @@ Vec3i floor(const Vec3f &v) {
   return vi;
 }
 
+/// Spread the low 21 bits of v so two zero bits follow each bit
+static uint64_t spreadBits(uint64_t v) {
+  v &= 0x1fffff;
+  v = (v | v << 32) & 0x1f00000000ffffull;
+  v = (v | v << 16) & 0x1f0000ff0000ffull;
+  v = (v | v << 8) & 0x100f00f00f00f00full;
+  v = (v | v << 4) & 0x10c30c30c30c30c3ull;
+  v = (v | v << 2) & 0x1249249249249249ull;
+  return v;
+}
+
+uint64_t mortonCode(const Vec3i &idx) {
+  return spreadBits(idx[0]) | spreadBits(idx[1]) << 1 | spreadBits(idx[2]) << 2;
+}
+
 Mat3f quadWeight(const Vec3f &particlePosIdx) {
   Vec3i basePos = floor(particlePosIdx - Vec3f::Constant(0.5f));
   Mat3f result;
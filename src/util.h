@@ -2,6 +2,8 @@
 
 #include "global.h"
 
+#include <cstdint>
+
 /**
  * Get the matrix representing the weight of a particle for its
  * surrounding 27 cells.
@@ -22,6 +24,12 @@ Mat3f quadWeightDeriv(const Vec3f &particlePosIdx);
  */
 Vec3i floor(const Vec3f &v);
 
+/**
+ * Morton code of a grid index, the bits of x, y and z interleaved
+ * @param idx non-negative grid index, at most 21 bits per axis
+ */
+uint64_t mortonCode(const Vec3i &idx);
+
 // e.g input: "3", '0', 4, output : "0003"
 std::string paddingStr(const std::string &str, char c, int targetLength);
 
@@ -0,0 +1,149 @@
+#include "weightBatch.h"
+
+#include <cmath>
+
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define MPM_X86_SIMD
+#include <immintrin.h>
+#endif
+
+// The vector versions repeat the scalar operations in the same order and
+// without fused multiply-add, which keeps them bit-identical to quadWeight.
+// AVX-512 implies FMA, so contraction has to be turned off explicitly.
+#if defined(__clang__)
+#pragma clang fp contract(off)
+#elif defined(__GNUC__)
+#pragma GCC optimize("fp-contract=off")
+#endif
+
+static void quadWeightScalar(const Float *x, int begin, int end, const WeightBatch &out) {
+  for (int p = begin; p < end; p++) {
+    int base = static_cast<int>(std::floor(x[p] - 0.5f));
+    Float d = x[p] - base;
+    out.base[p] = base;
+    out.weight[0][p] = 0.5f * (1.5f - d) * (1.5f - d);
+    out.weightDeriv[0][p] = d - 1.5f;
+    d -= 1.f;
+    out.weight[1][p] = 0.75f - d * d;
+    out.weightDeriv[1][p] = -2.f * d;
+    d -= 1.f;
+    out.weight[2][p] = 0.5f * (1.5f + d) * (1.5f + d);
+    out.weightDeriv[2][p] = d + 1.5f;
+  }
+}
+
+#ifdef MPM_X86_SIMD
+
+__attribute__((target("sse4.1")))
+static int quadWeightSSE(const Float *x, int count, const WeightBatch &out) {
+  const __m128 half = _mm_set1_ps(0.5f), oneHalf = _mm_set1_ps(1.5f), one = _mm_set1_ps(1.f),
+               threeQuarter = _mm_set1_ps(0.75f), minusTwo = _mm_set1_ps(-2.f);
+  int p = 0;
+  for (; p + 4 <= count; p += 4) {
+    __m128 xp = _mm_loadu_ps(x + p);
+    __m128 base = _mm_floor_ps(_mm_sub_ps(xp, half));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(out.base + p), _mm_cvttps_epi32(base));
+    __m128 d = _mm_sub_ps(xp, base);
+    __m128 t = _mm_sub_ps(oneHalf, d);
+    _mm_storeu_ps(out.weight[0] + p, _mm_mul_ps(_mm_mul_ps(half, t), t));
+    _mm_storeu_ps(out.weightDeriv[0] + p, _mm_sub_ps(d, oneHalf));
+    d = _mm_sub_ps(d, one);
+    _mm_storeu_ps(out.weight[1] + p, _mm_sub_ps(threeQuarter, _mm_mul_ps(d, d)));
+    _mm_storeu_ps(out.weightDeriv[1] + p, _mm_mul_ps(minusTwo, d));
+    d = _mm_sub_ps(d, one);
+    t = _mm_add_ps(oneHalf, d);
+    _mm_storeu_ps(out.weight[2] + p, _mm_mul_ps(_mm_mul_ps(half, t), t));
+    _mm_storeu_ps(out.weightDeriv[2] + p, _mm_add_ps(d, oneHalf));
+  }
+  return p;
+}
+
+__attribute__((target("avx2")))
+static int quadWeightAVX2(const Float *x, int count, const WeightBatch &out) {
+  const __m256 half = _mm256_set1_ps(0.5f), oneHalf = _mm256_set1_ps(1.5f),
+               one = _mm256_set1_ps(1.f), threeQuarter = _mm256_set1_ps(0.75f),
+               minusTwo = _mm256_set1_ps(-2.f);
+  int p = 0;
+  for (; p + 8 <= count; p += 8) {
+    __m256 xp = _mm256_loadu_ps(x + p);
+    __m256 base = _mm256_floor_ps(_mm256_sub_ps(xp, half));
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(out.base + p), _mm256_cvttps_epi32(base));
+    __m256 d = _mm256_sub_ps(xp, base);
+    __m256 t = _mm256_sub_ps(oneHalf, d);
+    _mm256_storeu_ps(out.weight[0] + p, _mm256_mul_ps(_mm256_mul_ps(half, t), t));
+    _mm256_storeu_ps(out.weightDeriv[0] + p, _mm256_sub_ps(d, oneHalf));
+    d = _mm256_sub_ps(d, one);
+    _mm256_storeu_ps(out.weight[1] + p, _mm256_sub_ps(threeQuarter, _mm256_mul_ps(d, d)));
+    _mm256_storeu_ps(out.weightDeriv[1] + p, _mm256_mul_ps(minusTwo, d));
+    d = _mm256_sub_ps(d, one);
+    t = _mm256_add_ps(oneHalf, d);
+    _mm256_storeu_ps(out.weight[2] + p, _mm256_mul_ps(_mm256_mul_ps(half, t), t));
+    _mm256_storeu_ps(out.weightDeriv[2] + p, _mm256_add_ps(d, oneHalf));
+  }
+  return p;
+}
+
+__attribute__((target("avx512f")))
+static int quadWeightAVX512(const Float *x, int count, const WeightBatch &out) {
+  const __m512 half = _mm512_set1_ps(0.5f), oneHalf = _mm512_set1_ps(1.5f),
+               one = _mm512_set1_ps(1.f), threeQuarter = _mm512_set1_ps(0.75f),
+               minusTwo = _mm512_set1_ps(-2.f);
+  int p = 0;
+  for (; p + 16 <= count; p += 16) {
+    __m512 xp = _mm512_loadu_ps(x + p);
+    // The zero-masked forms, the unmasked ones read an undefined register that GCC warns about
+    __m512 base = _mm512_maskz_roundscale_ps(0xffff, _mm512_sub_ps(xp, half),
+                                             _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC);
+    _mm512_storeu_si512(out.base + p, _mm512_maskz_cvttps_epi32(0xffff, base));
+    __m512 d = _mm512_sub_ps(xp, base);
+    __m512 t = _mm512_sub_ps(oneHalf, d);
+    _mm512_storeu_ps(out.weight[0] + p, _mm512_mul_ps(_mm512_mul_ps(half, t), t));
+    _mm512_storeu_ps(out.weightDeriv[0] + p, _mm512_sub_ps(d, oneHalf));
+    d = _mm512_sub_ps(d, one);
+    _mm512_storeu_ps(out.weight[1] + p, _mm512_sub_ps(threeQuarter, _mm512_mul_ps(d, d)));
+    _mm512_storeu_ps(out.weightDeriv[1] + p, _mm512_mul_ps(minusTwo, d));
+    d = _mm512_sub_ps(d, one);
+    t = _mm512_add_ps(oneHalf, d);
+    _mm512_storeu_ps(out.weight[2] + p, _mm512_mul_ps(_mm512_mul_ps(half, t), t));
+    _mm512_storeu_ps(out.weightDeriv[2] + p, _mm512_add_ps(d, oneHalf));
+  }
+  return p;
+}
+
+#endif
+
+SimdLevel detectSimdLevel() {
+#ifdef MPM_X86_SIMD
+  static const SimdLevel level = [] {
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) return SimdLevel::AVX512;
+    if (__builtin_cpu_supports("avx2")) return SimdLevel::AVX2;
+    if (__builtin_cpu_supports("sse4.1")) return SimdLevel::SSE;
+    return SimdLevel::SCALAR;
+  }();
+  return level;
+#else
+  return SimdLevel::SCALAR;
+#endif
+}
+
+void quadWeightBatch(const Float *posInGrid, int count, const WeightBatch &out, SimdLevel level) {
+  int done = 0;
+#ifdef MPM_X86_SIMD
+  switch (level) {
+    case SimdLevel::AVX512:
+      done = quadWeightAVX512(posInGrid, count, out);
+      break;
+    case SimdLevel::AVX2:
+      done = quadWeightAVX2(posInGrid, count, out);
+      break;
+    case SimdLevel::SSE:
+      done = quadWeightSSE(posInGrid, count, out);
+      break;
+    default:
+      break;
+  }
+#endif
+  // Remainder that doesn't fill a vector
+  quadWeightScalar(posInGrid, done, count, out);
+}
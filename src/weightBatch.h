@@ -0,0 +1,32 @@
+#pragma once
+
+#include "global.h"
+
+/// Instruction sets quadWeightBatch can run on
+enum class SimdLevel : int { SCALAR, SSE, AVX2, AVX512 };
+
+/// Widest instruction set supported by this CPU, detected once
+SimdLevel detectSimdLevel();
+
+/// Output arrays of quadWeightBatch, every array holds one entry per particle
+struct WeightBatch {
+  /// Lowest stencil node
+  int *base;
+  /// Weights of the 3 stencil nodes
+  Float *weight[3];
+  /// Weight derivatives of the 3 stencil nodes
+  Float *weightDeriv[3];
+};
+
+/**
+ * Quadratic B-spline weights and derivatives of many particles along one axis.
+ * Processes 16 (AVX-512), 8 (AVX2) or 4 (SSE) particles per instruction and
+ * gives the same results as quadWeight and quadWeightDeriv bit for bit.
+ * @param posInGrid particle coordinates along the axis in grid units, count entries
+ * @param count number of particles
+ * @param out output arrays
+ * @param level instruction set to use, defaults to the best the CPU supports,
+ *              must not be above detectSimdLevel()
+ */
+void quadWeightBatch(const Float *posInGrid, int count, const WeightBatch &out,
+                     SimdLevel level = detectSimdLevel());
@@ -0,0 +1,96 @@
+#include <cstdio>
+#include <random>
+#include <vector>
+
+#include "levelSet.h"
+
+/**
+ * Checks the bounds of the level sets: outside its box a level set is at least
+ * as far as the box, which the grid relies on to skip it. Also checks sdfBatch
+ * against sdf. Returns non-zero on a failure
+ */
+
+static Float boxDistance(const Vec3f &p, const Vec3f &lo, const Vec3f &hi) {
+  return (lo - p).cwiseMax(p - hi).cwiseMax(0.f).norm();
+}
+
+/// Number of points breaking the bounds or the batch of one level set
+static int check(const char *name, const LevelSet &ls) {
+  Vec3f lo, hi;
+  if (!ls.bounds(lo, hi)) {
+    printf("%-16s unbounded\n", name);
+    return 1;
+  }
+  // Points around the bounds, up to half the box further out
+  Vec3f center = 0.5f * (lo + hi), half = 0.5f * (hi - lo) + Vec3f::Constant(0.05f);
+  std::mt19937 rng(11);
+  std::uniform_real_distribution<Float> u(-2.f, 2.f);
+  const int count = 20000;
+  std::vector<Float> x(count), y(count), z(count), batch(count);
+  for (int i = 0; i < count; i++) {
+    x[i] = center[0] + u(rng) * half[0];
+    y[i] = center[1] + u(rng) * half[1];
+    z[i] = center[2] + u(rng) * half[2];
+  }
+  ls.sdfBatch(x.data(), y.data(), z.data(), count, batch.data());
+  int outside = 0, bad = 0;
+  for (int i = 0; i < count; i++) {
+    Vec3f p(x[i], y[i], z[i]);
+    Float d = ls.sdf(p), gap = boxDistance(p, lo, hi);
+    outside += gap > 0.f;
+    bool wrong = (gap > 0.f && d < gap - 1e-5f) || batch[i] != d;
+    if (wrong && bad++ < 4) {
+      printf("  %s at (%g, %g, %g): sdf %g batch %g box distance %g\n", name, p[0], p[1], p[2], d, batch[i], gap);
+    }
+  }
+  printf("%-16s %5d points outside the bounds, %s\n", name, outside, bad ? "FAILED" : "ok");
+  return bad;
+}
+
+static std::vector<uPtr<LevelSet>> spheres(const std::vector<Vec3f> &centers, Float radius) {
+  std::vector<uPtr<LevelSet>> result;
+  for (const Vec3f &c : centers) {
+    result.push_back(mkU<Sphere>(c, radius));
+  }
+  return result;
+}
+
+int main() {
+  int failures = 0;
+  const Vec3f c(0.5f, 0.5f, 0.5f);
+  // Three children in one spot fold the smooth minimum twice, dipping past k / 4
+  failures += check("smooth union 3", SmoothUnion(spheres({c, c, c}, 0.1f), 0.2f));
+  failures += check("smooth union", SmoothUnion(spheres({c, c + Vec3f(0.15f, 0.f, 0.f),
+                                                         c + Vec3f(0.f, 0.3f, 0.f)}, 0.1f), 0.1f));
+  failures += check("union", Union(spheres({c, c + Vec3f(0.3f, 0.1f, 0.f)}, 0.1f)));
+  failures += check("intersection", Intersection(spheres({c, c + Vec3f(0.1f, 0.f, 0.f)}, 0.1f)));
+  // Two crossing rods, away from the crossing the sdf is below the distance to the overlap of their boxes
+  std::vector<Vec3f> alongX, alongY;
+  for (int i = -10; i <= 10; i++) {
+    alongX.push_back(c + Vec3f(0.1f * i, 0.f, 0.f));
+    alongY.push_back(c + Vec3f(0.f, 0.1f * i, 0.f));
+  }
+  std::vector<uPtr<LevelSet>> rods;
+  rods.push_back(mkU<Union>(spheres(alongX, 0.1f)));
+  rods.push_back(mkU<Union>(spheres(alongY, 0.1f)));
+  failures += check("crossing rods", Intersection(std::move(rods)));
+  failures += check("difference", Difference(mkU<Sphere>(c, 0.2f), mkU<Sphere>(c + Vec3f(0.2f, 0.f, 0.f), 0.1f)));
+
+  // Narrow band of a small sphere in a larger volume, far tiles hold only the band
+  const Float spacing = 0.02f;
+  SDF volume(Vec3i(40, 40, 40), spacing);
+  Sphere sphere(Vec3f(0.3f, 0.4f, 0.4f), 0.1f);
+  for (int k = 0; k < 40; k++) {
+    for (int j = 0; j < 40; j++) {
+      for (int i = 0; i < 40; i++) {
+        volume.setSdf(Vec3i(i, j, k), sphere.sdf(Vec3f(i, j, k) * spacing));
+      }
+    }
+  }
+  failures += check("narrow band", NarrowBandSDF(volume, 2 * spacing));
+
+  TransformedLevelSet moved(mkU<Sphere>(Vec3f(0.1f, 0.f, 0.f), 0.1f));
+  moved.setTransform(Eigen::AngleAxis<Float>(0.7f, Vec3f(0.f, 0.f, 1.f)).toRotationMatrix(), c);
+  failures += check("transformed", moved);
+  return failures ? 1 : 0;
+}
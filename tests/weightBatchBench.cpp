@@ -0,0 +1,78 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+#include "interpKernel.h"
+#include "weightBatch.h"
+
+/**
+ * Particles per second of quadWeightBatch on every supported instruction set,
+ * next to the per particle kernel the transfers used before.
+ * Usage: WeightBatchBench [particles] [repeats]
+ */
+
+using Clock = std::chrono::steady_clock;
+
+static double seconds(Clock::time_point begin) {
+  return std::chrono::duration<double>(Clock::now() - begin).count();
+}
+
+int main(int argc, char **argv) {
+  const int count = argc > 1 ? atoi(argv[1]) : 1 << 20;
+  const int repeats = argc > 2 ? atoi(argv[2]) : 20;
+  std::mt19937 rng(7);
+  std::uniform_real_distribution<Float> grid(2.f, 126.f);
+  // One axis of every particle, three calls per particle make a full stencil
+  std::vector<Float> pos(3 * count);
+  for (Float &x : pos) {
+    x = grid(rng);
+  }
+  std::vector<int> base(count);
+  std::vector<Float> weight(3 * count), weightDeriv(3 * count);
+  WeightBatch out;
+  out.base = base.data();
+  for (int i = 0; i < 3; i++) {
+    out.weight[i] = weight.data() + i * count;
+    out.weightDeriv[i] = weightDeriv.data() + i * count;
+  }
+  double checksum = 0.;
+
+  Clock::time_point begin = Clock::now();
+  for (int r = 0; r < repeats; r++) {
+    for (int axis = 0; axis < 3; axis++) {
+      const Float *x = pos.data() + axis * count;
+      for (int p = 0; p < count; p++) {
+        Float w[3], dw[3];
+        base[p] = QuadraticKernel::eval(x[p], w, dw);
+        for (int i = 0; i < 3; i++) {
+          out.weight[i][p] = w[i];
+          out.weightDeriv[i][p] = dw[i];
+        }
+      }
+    }
+    checksum += weight[count / 2];
+  }
+  printf("%-14s %8.1f M particles/s\n", "per particle", 1e-6 * count * repeats / seconds(begin));
+
+  const char *names[] = {"batch scalar", "batch SSE4.1", "batch AVX2", "batch AVX-512"};
+  for (int l = 0; l <= static_cast<int>(SimdLevel::AVX512); l++) {
+    SimdLevel level = static_cast<SimdLevel>(l);
+    if (level > detectSimdLevel()) {
+      printf("%-14s skipped\n", names[l]);
+      continue;
+    }
+    begin = Clock::now();
+    for (int r = 0; r < repeats; r++) {
+      for (int axis = 0; axis < 3; axis++) {
+        quadWeightBatch(pos.data() + axis * count, count, out, level);
+      }
+      checksum += weight[count / 2];
+    }
+    printf("%-14s %8.1f M particles/s\n", names[l], 1e-6 * count * repeats / seconds(begin));
+  }
+  // Keeps the stores alive
+  printf("checksum %g\n", checksum);
+  return 0;
+}
@@ -0,0 +1,103 @@
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <vector>
+
+#include "interpKernel.h"
+#include "util.h"
+#include "weightBatch.h"
+
+/**
+ * Checks quadWeightBatch against the scalar quadratic weights bit for bit,
+ * for every instruction set this CPU supports. Returns non-zero on a mismatch
+ */
+
+static const char *levelName(SimdLevel level) {
+  switch (level) {
+    case SimdLevel::SCALAR: return "scalar";
+    case SimdLevel::SSE: return "SSE4.1";
+    case SimdLevel::AVX2: return "AVX2";
+    case SimdLevel::AVX512: return "AVX-512";
+  }
+  return "";
+}
+
+static bool sameBits(Float a, Float b) {
+  return std::memcmp(&a, &b, sizeof(Float)) == 0;
+}
+
+/// Positions on and next to cell boundaries and half cells, negative ones included
+static std::vector<Float> edgePositions() {
+  std::vector<Float> pos;
+  for (int i = -4; i <= 4; i++) {
+    for (Float offset : {0.f, 0.5f, 0.25f, 0.75f}) {
+      Float x = i + offset;
+      pos.push_back(x);
+      pos.push_back(std::nextafter(x, -INFINITY));
+      pos.push_back(std::nextafter(x, INFINITY));
+    }
+  }
+  for (Float x : {-0.f, 1e-7f, -1e-7f, 63.5f, 1023.999f, -1023.999f}) {
+    pos.push_back(x);
+  }
+  return pos;
+}
+
+/// Number of mismatching particles of one level
+static int check(const std::vector<Float> &pos, SimdLevel level) {
+  int count = pos.size();
+  std::vector<int> base(count);
+  std::vector<Float> weight(3 * count), weightDeriv(3 * count);
+  WeightBatch out;
+  out.base = base.data();
+  for (int i = 0; i < 3; i++) {
+    out.weight[i] = weight.data() + i * count;
+    out.weightDeriv[i] = weightDeriv.data() + i * count;
+  }
+  quadWeightBatch(pos.data(), count, out, level);
+  int mismatches = 0;
+  for (int p = 0; p < count; p++) {
+    // util.h along x and the kernel used by the transfers
+    Mat3f w = quadWeight(Vec3f(pos[p], 0.f, 0.f));
+    Mat3f dw = quadWeightDeriv(Vec3f(pos[p], 0.f, 0.f));
+    Float kw[3], kdw[3];
+    int kBase = QuadraticKernel::eval(pos[p], kw, kdw);
+    bool same = base[p] == kBase && base[p] == static_cast<int>(std::floor(pos[p] - 0.5f));
+    for (int i = 0; i < 3; i++) {
+      Float bw = weight[i * count + p], bdw = weightDeriv[i * count + p];
+      same = same && sameBits(bw, w(0, i)) && sameBits(bdw, dw(0, i)) && sameBits(bw, kw[i]) &&
+             sameBits(bdw, kdw[i]);
+    }
+    if (!same && mismatches++ < 8) {
+      printf("  %s mismatch at x = %.9g\n", levelName(level), pos[p]);
+    }
+  }
+  return mismatches;
+}
+
+int main() {
+  std::mt19937 rng(7);
+  std::uniform_real_distribution<Float> grid(-2.f, 130.f);
+  std::vector<Float> random(10007);
+  for (Float &x : random) {
+    x = grid(rng);
+  }
+  std::vector<Float> edges = edgePositions();
+  int failures = 0;
+  for (int l = 0; l <= static_cast<int>(SimdLevel::AVX512); l++) {
+    SimdLevel level = static_cast<SimdLevel>(l);
+    if (level > detectSimdLevel()) {
+      printf("%-8s skipped, not supported by this CPU\n", levelName(level));
+      continue;
+    }
+    int mismatches = check(random, level) + check(edges, level);
+    // Counts that leave remainders for every vector width
+    for (int count = 1; count <= 33; count++) {
+      mismatches += check(std::vector<Float>(edges.begin(), edges.begin() + count), level);
+    }
+    printf("%-8s %s\n", levelName(level), mismatches ? "FAILED" : "ok");
+    failures += mismatches;
+  }
+  return failures ? 1 : 0;
+}